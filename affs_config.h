@@ -68,4 +68,12 @@ typedef signed long s32;
 #error howto typedef s32?
 #endif
 
+#if SIZEOF_UNSIGNED_LONG==8
+typedef unsigned long u64;
+#elif SIZEOF_UNSIGNED_LONG_LONG==8
+typedef unsigned long long u64;
+#else
+#error howto typedef u64?
+#endif
+
 #endif /* AFFS_CONFIG_H */
@@ -49,10 +49,17 @@ static struct argp_option argo[] = {
 	{ "root",	'b',	"block",	0,	"Specify root block" },
 	{ "size",	's',	"size",		0,	"Force blocksize" },
 	{ "reserve",	'r',	"blocks",	0,	"Set reserved blocks" },
+	{ "cache",	'm',	"kbytes",	0,	"Set block cache size" },
 	{ "readonly",	'n',	0,		0,	"No changes to the filesystem" },
 	{ "force",	'f',	0,		0,	"Force filesystem check" },
 	{ "clear",	'c',	0,		0,	"Clear bitmap flag" },
 	{ "write",	'w',	0,		0,	"Write bitmap" },
+	{ "lowmem",	'l',	0,		0,	"Keep only one bitmap in memory" },
+	{ "elevator",	'e',	0,		0,	"Check the directory tree in block order" },
+	{ "jobs",	'j',	"threads",	0,	"Check the directory tree with several threads" },
+	{ "depth",	'd',	"levels",	0,	"Limit the depth of the directory tree" },
+	{ "data",	'x',	0,		0,	"Check the data blocks of OFS files" },
+	{ "format",	'o',	"format",	0,	"Output format (text, json or csv)" },
 	{ 0 }
 };
 
@@ -68,7 +75,7 @@ typedef int error_t;
 
 static void argp_usage(struct argp_state *state)
 {
-	fprintf(stderr,"Usage: affsck [-fvncw] [-b root] [-s blocksize] [-r reserved] devicefile\n");
+	fprintf(stderr,"Usage: affsck [-fvncwlex] [-b root] [-s blocksize] [-r reserved] [-m kbytes] [-j threads] [-d levels] [-o format] devicefile\n");
 	exit(1);
 }
 #endif
@@ -98,6 +105,9 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 	case 'f':
 		info.force = 1;
 		break;
+	case 'm':
+		info.cachesize = atoi(arg);
+		break;
 	case 'r':
 		info.reserved = atoi(arg);
 		if (!info.reserved) {
@@ -111,6 +121,37 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 	case 'w':
 		info.write = 1;
 		break;
+	case 'l':
+		info.lowmem = 1;
+		break;
+	case 'e':
+		info.elevator = 1;
+		break;
+	case 'j':
+		info.jobs = atoi(arg);
+		if (info.jobs < 1 || info.jobs > AFFS_THREADS_MAX) {
+			affs_error("number of threads must be between 1 and %d\n", AFFS_THREADS_MAX);
+			exit(1);
+		}
+		break;
+	case 'd':
+		info.maxdepth = atoi(arg);
+		break;
+	case 'x':
+		info.datacheck = 1;
+		break;
+	case 'o':
+		if (!strcmp(arg, "text"))
+			info.format = AFFS_FORMAT_TEXT;
+		else if (!strcmp(arg, "json"))
+			info.format = AFFS_FORMAT_JSON;
+		else if (!strcmp(arg, "csv"))
+			info.format = AFFS_FORMAT_CSV;
+		else {
+			affs_error("unknown output format %s\n", arg);
+			exit(1);
+		}
+		break;
 #if HAVE_ARGP_H
 	case ARGP_KEY_ARG:
 		if (state->arg_num >= 1)
@@ -139,6 +180,13 @@ int main(int argc, char **argv)
 
 	memset(&info, 0, sizeof(info));
 	info.reserved = 2;
+	info.cachesize = AFFS_CACHESIZE_DEF;
+	info.threads = 1;
+	info.jobs = 1;
+	info.maxdepth = AFFS_DEPTH_DEF;
+#ifdef _SC_NPROCESSORS_ONLN
+	info.threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
 
 #if HAVE_ARGP_H
 	if (argp_parse(&argp, argc, argv, 0, 0, &info))
@@ -146,7 +194,7 @@ int main(int argc, char **argv)
 #else
 {
 	int c;
-	while ((c = getopt (argc, argv, "vb:s:r:nf")) != -1) {
+	while ((c = getopt (argc, argv, "vb:s:r:m:nflej:d:xo:")) != -1) {
 		parse_opt(c, optarg, NULL);
 	}
 	if (optind >= argc) {
@@ -170,6 +218,7 @@ int main(int argc, char **argv)
 
 	if (S_ISREG(stat.st_mode)) {
 		info.blocks = stat.st_size / 512;
+		affs_map_device(stat.st_size);
 	} else if (S_ISBLK(stat.st_mode)) {
 		ioctl(info.devfd, BLKGETSIZE, &info.blocks);
 	} else {
@@ -185,7 +234,7 @@ int main(int argc, char **argv)
 	if (info.clear) {
 		root_tail->bitmap_flag = 0;
 		affs_write_root();
-		return 0;
+		return affs_bsync();
 	}
 
 	if (affs_detect_type())
@@ -204,22 +253,39 @@ int main(int argc, char **argv)
 	info.datablocksize = info.blocksize;
 	if (info.ofs)
 		info.datablocksize -= 6 * 4;
+	else if (info.datacheck) {
+		affs_print(1, "data blocks of a fast filesystem can't be checked\n");
+		info.datacheck = 0;
+	}
 
 	if (affs_read_bitmap())
 		return 1;
 
-	if (info.dcache)
-		affs_read_dcache(be32_to_cpu((root_tail->dcache)));
-
-	if (affs_read_dir(AFFS_ROOT_HEAD(affs_rootbuf)->hashtable))
+	if (affs_read_tree())
+		return 1;
+	if (affs_inode_index())
+		return 1;
+	if (affs_fix_hash())
+		return 1;
+	if (affs_check_links())
+		return 1;
+	if (affs_check_data())
+		return 1;
+	if (affs_verify_dcache())
 		return 1;
 
 	affs_cmp_bitmap();
+	affs_print(1, "%u of %u blocks free\n", affs_free_blocks(), info.blocks - info.reserved);
 
 	if (info.write) {
 		affs_write_bitmap();
 		affs_write_root();
+		affs_bsync();
 	}
 
+	affs_cache_stat();
+	affs_inode_stat();
+	affs_inode_free();
+
 	return 0;
 }
@@ -29,6 +29,38 @@
 #define AFFS_BLOCKSHIFT_MAX	12
 
 #define AFFS_ROOT_BMAPS		25
+/* max. length of a name that is significant and of a comment */
+#define AFFS_NAME_MAX		30
+#define AFFS_COMMENT_MAX	79
+
+#define AFFS_CACHESIZE_DEF	1024
+/* max. # of blocks transferred in one request */
+#define AFFS_RUN_MAX		64
+/* max. # of data blocks read in one request (see affs_check_data) */
+#define AFFS_DATA_RUN		256
+/* max. # of worker threads */
+#define AFFS_THREADS_MAX	16
+/* default max. depth of the directory tree */
+#define AFFS_DEPTH_DEF		1024
+
+/* output formats */
+#define AFFS_FORMAT_TEXT	0
+#define AFFS_FORMAT_JSON	1
+#define AFFS_FORMAT_CSV		2
+
+#ifdef __GNUC__
+#define affs_atomic_add(ptr, val)	__atomic_fetch_add(ptr, val, __ATOMIC_RELAXED)
+/* clear the mask bits in *ptr, returns which of them were set */
+#define affs_atomic_clear(ptr, mask)	(__atomic_fetch_and(ptr, ~(mask), __ATOMIC_RELAXED) & (mask))
+/* publish/get a value, that was initialized by another thread */
+#define affs_atomic_load(ptr)		__atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define affs_atomic_store(ptr, val)	__atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+#else
+#define affs_atomic_add(ptr, val)	(*(ptr) += (val))
+#define affs_atomic_clear(ptr, mask)	((*(ptr) & (mask)) ? (*(ptr) &= ~(mask), (mask)) : 0)
+#define affs_atomic_load(ptr)		(*(ptr))
+#define affs_atomic_store(ptr, val)	(*(ptr) = (val))
+#endif
 
 struct affs_info {
 	char *name;
@@ -39,17 +71,51 @@ struct affs_info {
 	u32 blocksize;
 	u32 datablocksize;
 	u32 blockshift;
+	/* # of entries in hash/block tables (see affs_set_blocksize) */
+	u32 hashsize;
 	u32 blocks;
 	u32 lastalloc;
+	/* size of block cache in KB */
+	u32 cachesize;
+	/* # of worker threads */
+	u32 threads;
+	/* # of threads walking the directory tree (see affs_read_tree) */
+	u32 jobs;
+	/* directories below this depth aren't entered */
+	u32 maxdepth;
 	int verbose;
+	/* output format, one of AFFS_FORMAT_* */
+	int format;
 	struct {
+		/* # of errors reported and # of them found by the walk */
+		u32 errors;
+		u32 tree;
+		/* # of errors in the dcache chains (not counted in tree) */
+		u32 dcache;
 		/* # of errors during bitmap read */
 		u32 bitmap_block;
 		/* # of blocks not marked free in bitmap */
 		u32 bitmap_free;
 		/* # of blocks not allocated in bitmap */
 		u32 bitmap_alloc;
+		/*
+		 * # of directories not entered (see affs_check_depth) and
+		 * blocks that couldn't be marked (out of memory), the new
+		 * bitmap misses blocks then, so it mustn't be used
+		 */
+		u32 bitmap_missing;
 	} errstat;
+	struct {
+		/* # of reads satisfied by the block cache */
+		u32 hit;
+		/* # of reads that had to go to the device */
+		u32 miss;
+		/* # of blocks announced to the kernel for readahead */
+		u32 prefetch;
+		/* # of guessed extension blocks and # of correct guesses */
+		u32 guess;
+		u32 guess_hit;
+	} cachestat;
 	int read : 1;
 	int force : 1;
 	int clear : 1;
@@ -58,6 +124,9 @@ struct affs_info {
 	int mufs : 1;
 	int intl : 1;
 	int dcache : 1;
+	int lowmem : 1;
+	int elevator : 1;
+	int datacheck : 1;
 };
 
 
@@ -205,8 +274,14 @@ extern u8 *affs_new_bitmap;
 extern u8 *affs_old_bitmap;
 
 extern int affs_alloc_block(u32 block);
+extern int affs_claim_block(u32 block, u32 owner);
+extern int affs_release_block(u32 block);
+extern void affs_cross_start(void);
+extern void affs_cross_report(void);
 extern u32 affs_alloc_new_block(void);
+extern u32 affs_alloc_extent(u32 goal, u32 count, u32 *len);
 extern int affs_test_block(u32 block);
+extern u32 affs_free_blocks(void);
 extern int affs_read_bitmap(void);
 extern int affs_write_bitmap(void);
 extern u32 affs_cmp_bitmap(void);
@@ -216,9 +291,42 @@ extern int affs_create_bitmap(void);
 extern u_char affs_rootbuf[AFFS_BLOCKSIZE_MAX];
 extern u_char affs_databuf[AFFS_BLOCKSIZE_MAX];
 
+extern int affs_set_blocksize(u32 size);
+extern int affs_map_device(off_t size);
+extern int affs_bsync(void);
 extern int affs_bread(void *data, u32 block);
+extern void *affs_bget(void *data, u32 block);
 extern int affs_bwrite(void *data, u32 block);
+extern int affs_bread_run(void *data, u32 block, u32 cnt);
+extern void *affs_bget_run(void *data, u32 block, u32 cnt);
+extern int affs_bwrite_run(void *data, u32 block, u32 cnt);
+struct iovec;
+extern int affs_bwritev(struct iovec *iov, int iovcnt, u32 block, u32 cnt);
+extern void affs_bprefetch(u32 *table, u32 cnt);
+
+struct affs_readahead {
+	/* last block of the chain and the guess for the next one */
+	u32 last, guess;
+};
+
+extern void affs_breadahead_init(struct affs_readahead *ra, u32 block);
+extern void affs_breadahead(struct affs_readahead *ra, u32 next, u32 left, u32 *table);
+extern void affs_cache_stat(void);
+
+/* checksum.c */
+/* index of the version for any number of longwords */
+#define AFFS_CHECKSUM_ANY	(AFFS_BLOCKSHIFT_MAX - AFFS_BLOCKSHIFT_MIN + 1)
+
+struct affs_checksum_impl {
+	const char *name;
+	/* a version for every blocksize, the last one for any size */
+	u32 (* const *sized)(u32 *ptr, u32 cnt);
+};
+
+extern const struct affs_checksum_impl *affs_checksum_impls(u32 *cnt);
 extern u32 affs_checksum(void *data);
+extern u32 affs_checksum_words(void *data, u32 cnt);
+extern u32 affs_name_hash(u8 *name);
 
 /* inode.c */
 extern int affs_detect_type(void);
@@ -228,14 +336,80 @@ extern void affs_init_root(void);
 extern int affs_write_root(void);
 extern void affs_print_link(u8 *buf);
 extern void affs_print_file(u8 *buf);
-extern int affs_read_file(u8 *buf);
+extern int affs_read_file(u32 block, u8 *buf);
 extern void affs_print_dir(u8 *buf);
-extern int affs_read_dcache(u32 block);
-extern int affs_read_dir(u32 *hashtable);
+extern int affs_read_dcache(u32 dir, u32 block);
+extern int affs_read_dir(u32 dir, u32 *hashtable, u32 base);
+extern int affs_read_tree(void);
+extern int affs_fix_hash(void);
+extern int affs_check_data(void);
+
+/* dcache.c */
+extern void affs_dcache_block(u32 dir, u32 block);
+extern int affs_verify_dcache(void);
+extern int affs_create_dcache(u32 dir);
+
+/* itable.c */
+struct affs_inode {
+	u32 key;
+	u32 parent;
+	/* directory it was found in (not its parent, if that's wrong) */
+	u32 dir;
+	u32 size;
+	u32 protect;
+	u32 days;
+	u16 mins, ticks;
+	/* first extension block of a file, first dcache block of a directory */
+	u32 extension;
+	u32 original;
+	u32 link_chain;
+	/* offset of the name and the comment in the name pool (see affs_inode_name) */
+	u32 name;
+	u32 comment;
+	s8 type;
+	/* free for the checks done after the walk */
+	u8 flags;
+};
+
+extern void affs_inode_add(u32 dir, u32 entry, u8 *buf);
+extern int affs_inode_index(void);
+extern u32 affs_inode_count(void);
+extern struct affs_inode *affs_inode_nth(u32 i);
+extern struct affs_inode *affs_inode_find(u32 key);
+extern u8 *affs_inode_name(struct affs_inode *inode);
+extern u8 *affs_inode_comment(struct affs_inode *inode);
+extern void affs_inode_stat(void);
+extern void affs_inode_free(void);
+
+/* link.c */
+extern int affs_check_links(void);
 
 /* util.c */
+struct affs_output {
+	char *buf;
+	size_t len, size;
+	/* start and kind of the unfinished line (only in the structured formats) */
+	size_t line;
+	int kind;
+};
+
+/* an entry of the directory listing, the strings are BCPL strings */
+struct affs_listing {
+	u32 key;
+	s32 type;
+	u32 size;
+	u32 protect;
+	u32 original;
+	struct affs_date *date;
+	u8 *name;
+	u8 *comment;
+};
+
+extern void affs_set_output(struct affs_output *out);
 extern void affs_print(int level, char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
 extern void affs_error(char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
+extern void affs_write(char *buf, size_t len);
+extern void affs_print_entry(int level, struct affs_listing *entry);
 
 
 #ifdef WORDS_BIGENDIAN
@@ -263,9 +437,11 @@ extern void affs_error(char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
 #define AFFS_FILE_HEAD(buf)	((struct affs_file_head *)buf)
 #define AFFS_FILE_TAIL(buf)	((struct affs_file_tail *)((uintptr_t)buf+info.blocksize-sizeof(struct affs_file_tail)))
 
+#define AFFS_DATA_HEAD(buf)	((struct affs_data_head *)buf)
+
 
-#define AFFS_HASHTABLESIZE	((info.blocksize/4)-56)
-#define AFFS_BLOCKTABLESIZE	((info.blocksize/4)-56)
+#define AFFS_HASHTABLESIZE	(info.hashsize)
+#define AFFS_BLOCKTABLESIZE	(info.hashsize)
 
 
 #define AFFS_PTYPE(buf)		(*(u32 *)buf)
@@ -290,7 +466,7 @@ extern void affs_error(char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
 #define T_SHORT		2
 #define T_DATA		8
 #define T_LIST		16
-#define T_DCACHE	17
+#define T_DIRC		33
 
 #define ST_LINKFILE	-4
 #define ST_FILE		-3
@@ -21,16 +21,672 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#if HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
 #include "amigaffs.h"
 
 
 u8 *affs_new_bitmap;
 u8 *affs_old_bitmap;
 
-int affs_alloc_block(u32 block)
+/* buffer for multi block transfers */
+static u8 affs_runbuf[AFFS_RUN_MAX * AFFS_BLOCKSIZE_MAX];
+/* part of the old bitmap, if it's not kept in memory (see affs_cmp_bitmap) */
+static u8 affs_streambuf[AFFS_RUN_MAX * AFFS_BLOCKSIZE_MAX];
+/* location of the bitmap blocks (from the root and extension blocks) */
+static u32 *affs_bitmap_blk;
+static u32 affs_bitmap_cnt;
+/* bitmap blocks to be written (all of them, if not allocated) */
+static u8 *affs_bitmap_dirty;
+
+/*
+ * On large volumes the new bitmap isn't a flat array, but is kept in
+ * chunks of AFFS_CHUNK_BITS blocks, which only record the used blocks.
+ * So the memory needed depends on how much of the volume is used and
+ * how fragmented it is, not on its size. A chunk is either
+ *  - an array of the sorted numbers of the used blocks (an empty array
+ *    doesn't need any memory, so a free chunk costs nothing),
+ *  - a run chunk with the sorted ranges of used blocks,
+ *  - or a dense chunk, which is a part of the flat bitmap.
+ * Arrays become run chunks if that needs much less memory, both become
+ * dense chunks when they would get bigger than that.
+ * Chunk c contains the words [c * AFFS_CHUNK_WORDS, (c + 1) * AFFS_CHUNK_WORDS)
+ * of the flat bitmap, affs_new_window returns them in that format.
+ */
+#ifndef AFFS_FLAT_MAX
+#define AFFS_FLAT_MAX		(1 << 22)
+#endif
+#define AFFS_CHUNK_SHIFT	16
+#define AFFS_CHUNK_BITS		(1 << AFFS_CHUNK_SHIFT)
+#define AFFS_CHUNK_WORDS	(AFFS_CHUNK_BITS / 32)
+/* array and run chunks don't get bigger than a dense chunk */
+#define AFFS_CHUNK_ARRAY_MAX	(AFFS_CHUNK_BITS / 16)
+#define AFFS_CHUNK_RUN_MAX	(AFFS_CHUNK_BITS / 32)
+
+enum { AFFS_CHUNK_ARRAY, AFFS_CHUNK_RUN, AFFS_CHUNK_DENSE };
+
+struct affs_run {
+	u16 first, last;
+};
+
+struct affs_chunk {
+	u8 type;
+	/* # of used and allocated entries of an array or run chunk */
+	u16 cnt, size;
+	/* # of used blocks and # of ranges of used blocks */
+	u32 used, runs;
+	union {
+		u16 *array;
+		struct affs_run *run;
+		u32 *dense;
+	} u;
+};
+
+static struct affs_chunk *affs_new_chunks;
+static u32 affs_chunk_cnt;
+/* a free chunk and chunks converted to the flat format */
+static u32 affs_chunk_free[AFFS_CHUNK_WORDS];
+static u32 affs_chunkbuf[AFFS_CHUNK_WORDS];
+static u32 affs_fixbuf[AFFS_CHUNK_WORDS];
+
+/* set if a chunk couldn't grow, the new bitmap misses blocks then */
+static int affs_chunk_nomem;
+
+/* index of the first entry >= bit */
+static u32 affs_array_find(u16 *array, u32 cnt, u32 bit)
+{
+	u32 lo = 0, hi = cnt, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (array[mid] < bit)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* index of the first run, which doesn't end before bit */
+static u32 affs_run_find(struct affs_run *run, u32 cnt, u32 bit)
+{
+	u32 lo = 0, hi = cnt, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (run[mid].last < bit)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* mark the bits [first, last] as used in a flat bitmap */
+static void affs_clear_bits(u32 *map, u32 first, u32 last)
+{
+	u32 w, mask;
+
+	for (; first <= last; first = (w + 1) * 32) {
+		w = first / 32;
+		mask = ~0U << (first & 31);
+		if (last < w * 32 + 31)
+			mask &= ~0U >> (31 - (last & 31));
+		map[w] &= ~cpu_to_be32(mask);
+	}
+}
+
+/* the chunk in the flat format, buf is used if necessary */
+static u32 *affs_chunk_get(struct affs_chunk *c, u32 *buf)
+{
+	u32 i;
+
+	if (c->type == AFFS_CHUNK_DENSE)
+		return c->u.dense;
+	if (!c->used)
+		return affs_chunk_free;
+	memset(buf, 0xff, AFFS_CHUNK_WORDS * 4);
+	if (c->type == AFFS_CHUNK_ARRAY) {
+		for (i = 0; i < c->cnt; ++i)
+			buf[c->u.array[i] / 32] &= ~cpu_to_be32(1U << (c->u.array[i] & 31));
+	} else {
+		for (i = 0; i < c->cnt; ++i)
+			affs_clear_bits(buf, c->u.run[i].first, c->u.run[i].last);
+	}
+	return buf;
+}
+
+/* returns 1 if there is no memory for the dense chunk */
+static int affs_chunk_dense(struct affs_chunk *c)
+{
+	u32 *dense;
+
+	dense = malloc(AFFS_CHUNK_WORDS * 4);
+	if (!dense)
+		return 1;
+	affs_chunk_get(c, dense);
+	free(c->u.array);
+	c->u.dense = dense;
+	c->type = AFFS_CHUNK_DENSE;
+	c->cnt = c->size = 0;
+	return 0;
+}
+
+static void affs_chunk_runs(struct affs_chunk *c)
+{
+	struct affs_run *run;
+	u32 i, n;
+
+	/* without memory for it, the chunk simply stays an array */
+	run = malloc(c->runs * sizeof(*run));
+	if (!run)
+		return;
+	for (i = n = 0; i < c->cnt; ++i) {
+		if (n && run[n - 1].last + 1 == c->u.array[i])
+			run[n - 1].last++;
+		else
+			run[n].first = run[n].last = c->u.array[i], n++;
+	}
+	free(c->u.array);
+	c->u.run = run;
+	c->type = AFFS_CHUNK_RUN;
+	c->cnt = c->size = n;
+}
+
+/*
+ * make room for another entry, returns 1 if the chunk became dense and
+ * -1 if there is no memory for it.
+ */
+static int affs_chunk_grow(struct affs_chunk *c, u32 max, size_t entry)
+{
+	void *ptr;
+	u32 size;
+
+	if (c->cnt < c->size)
+		return 0;
+	if (c->cnt >= max)
+		return affs_chunk_dense(c) ? -1 : 1;
+	size = c->size ? 2 * c->size : 4;
+	if (size > max)
+		size = max;
+	ptr = realloc(c->u.array, size * entry);
+	if (!ptr)
+		return -1;
+	c->u.array = ptr;
+	c->size = size;
+	return 0;
+}
+
+static int affs_chunk_test(struct affs_chunk *c, u32 bit)
+{
+	u32 i;
+
+	switch (c->type) {
+	case AFFS_CHUNK_ARRAY:
+		i = affs_array_find(c->u.array, c->cnt, bit);
+		return i < c->cnt && c->u.array[i] == bit;
+	case AFFS_CHUNK_RUN:
+		i = affs_run_find(c->u.run, c->cnt, bit);
+		return i < c->cnt && c->u.run[i].first <= bit;
+	default:
+		return !(c->u.dense[bit / 32] & cpu_to_be32(1U << (bit & 31)));
+	}
+}
+
+/* mark bit as used, returns 1 if it already is and -1 if out of memory */
+static int affs_chunk_use(struct affs_chunk *c, u32 bit)
+{
+	struct affs_run *run;
+	u16 *array;
+	u32 i, mask;
+	int prev, next, res;
+
+	switch (c->type) {
+	case AFFS_CHUNK_ARRAY:
+		i = affs_array_find(c->u.array, c->cnt, bit);
+		if (i < c->cnt && c->u.array[i] == bit)
+			return 1;
+		res = affs_chunk_grow(c, AFFS_CHUNK_ARRAY_MAX, sizeof(*array));
+		if (res)
+			return res < 0 ? res : affs_chunk_use(c, bit);
+		array = c->u.array;
+		prev = i > 0 && array[i - 1] + 1 == bit;
+		next = i < c->cnt && array[i] == bit + 1;
+		memmove(array + i + 1, array + i, (c->cnt - i) * sizeof(*array));
+		array[i] = bit;
+		c->cnt++;
+		break;
+	case AFFS_CHUNK_RUN:
+		i = affs_run_find(c->u.run, c->cnt, bit);
+		if (i < c->cnt && c->u.run[i].first <= bit)
+			return 1;
+		run = c->u.run;
+		prev = i > 0 && run[i - 1].last + 1 == bit;
+		next = i < c->cnt && run[i].first == bit + 1;
+		if (prev && next) {
+			run[i - 1].last = run[i].last;
+			memmove(run + i, run + i + 1, (c->cnt - i - 1) * sizeof(*run));
+			c->cnt--;
+		} else if (prev) {
+			run[i - 1].last = bit;
+		} else if (next) {
+			run[i].first = bit;
+		} else {
+			res = affs_chunk_grow(c, AFFS_CHUNK_RUN_MAX, sizeof(*run));
+			if (res)
+				return res < 0 ? res : affs_chunk_use(c, bit);
+			run = c->u.run;
+			memmove(run + i + 1, run + i, (c->cnt - i) * sizeof(*run));
+			run[i].first = run[i].last = bit;
+			c->cnt++;
+		}
+		break;
+	default:
+		mask = cpu_to_be32(1U << (bit & 31));
+		if (!(c->u.dense[bit / 32] & mask))
+			return 1;
+		c->u.dense[bit / 32] &= ~mask;
+		c->used++;
+		return 0;
+	}
+	c->used++;
+	c->runs += 1 - prev - next;
+	/* runs need twice the memory per entry, switch if they need half of it */
+	if (c->type == AFFS_CHUNK_ARRAY && c->used >= 16 && 4 * c->runs <= c->used)
+		affs_chunk_runs(c);
+	return 0;
+}
+
+/* mark bit as free again, returns 1 if it already is and -1 if out of memory */
+static int affs_chunk_unuse(struct affs_chunk *c, u32 bit)
+{
+	struct affs_run *run;
+	u16 *array;
+	u32 i, mask;
+	int prev, next, res;
+
+	switch (c->type) {
+	case AFFS_CHUNK_ARRAY:
+		i = affs_array_find(c->u.array, c->cnt, bit);
+		if (i >= c->cnt || c->u.array[i] != bit)
+			return 1;
+		array = c->u.array;
+		prev = i > 0 && array[i - 1] + 1 == bit;
+		next = i + 1 < c->cnt && array[i + 1] == bit + 1;
+		memmove(array + i, array + i + 1, (c->cnt - i - 1) * sizeof(*array));
+		c->cnt--;
+		break;
+	case AFFS_CHUNK_RUN:
+		i = affs_run_find(c->u.run, c->cnt, bit);
+		if (i >= c->cnt || c->u.run[i].first > bit)
+			return 1;
+		run = c->u.run;
+		prev = run[i].first < bit;
+		next = run[i].last > bit;
+		if (prev && next) {
+			/* split the run */
+			res = affs_chunk_grow(c, AFFS_CHUNK_RUN_MAX, sizeof(*run));
+			if (res)
+				return res < 0 ? res : affs_chunk_unuse(c, bit);
+			run = c->u.run;
+			memmove(run + i + 1, run + i, (c->cnt - i) * sizeof(*run));
+			run[i].last = bit - 1;
+			run[i + 1].first = bit + 1;
+			c->cnt++;
+		} else if (prev) {
+			run[i].last = bit - 1;
+		} else if (next) {
+			run[i].first = bit + 1;
+		} else {
+			memmove(run + i, run + i + 1, (c->cnt - i - 1) * sizeof(*run));
+			c->cnt--;
+		}
+		break;
+	default:
+		mask = cpu_to_be32(1U << (bit & 31));
+		if (c->u.dense[bit / 32] & mask)
+			return 1;
+		c->u.dense[bit / 32] |= mask;
+		c->used--;
+		return 0;
+	}
+	c->used--;
+	c->runs += prev + next - 1;
+	return 0;
+}
+
+static void affs_chunk_stat(void)
+{
+	u32 i, cnt[3], size;
+
+	cnt[0] = cnt[1] = cnt[2] = 0;
+	size = affs_chunk_cnt * sizeof(struct affs_chunk);
+	for (i = 0; i < affs_chunk_cnt; ++i) {
+		cnt[affs_new_chunks[i].type]++;
+		if (affs_new_chunks[i].type == AFFS_CHUNK_DENSE)
+			size += AFFS_CHUNK_WORDS * 4;
+		else if (affs_new_chunks[i].type == AFFS_CHUNK_RUN)
+			size += affs_new_chunks[i].size * sizeof(struct affs_run);
+		else
+			size += affs_new_chunks[i].size * sizeof(u16);
+	}
+	affs_print(1, "bitmap chunks: %u array, %u run, %u dense (%u KB)\n",
+		   cnt[AFFS_CHUNK_ARRAY], cnt[AFFS_CHUNK_RUN], cnt[AFFS_CHUNK_DENSE],
+		   (size + 1023) / 1024);
+}
+
+/*
+ * words [c * AFFS_CHUNK_WORDS, (c + 1) * AFFS_CHUNK_WORDS) of the new
+ * bitmap, buf is used if necessary.
+ */
+static u32 *affs_new_window(u32 c, u32 *buf)
+{
+	if (affs_new_bitmap)
+		return (u32 *)affs_new_bitmap + c * AFFS_CHUNK_WORDS;
+	return affs_chunk_get(&affs_new_chunks[c], buf);
+}
+
+/* copy len bytes at offset off (a multiple of 4) of the new bitmap to dst */
+static void affs_new_copy(u8 *dst, u32 off, u32 len)
+{
+	u32 c, n;
+
+	for (; len; dst += n, off += n, len -= n) {
+		c = off / (AFFS_CHUNK_WORDS * 4);
+		n = (c + 1) * AFFS_CHUNK_WORDS * 4 - off;
+		if (n > len)
+			n = len;
+		memcpy(dst, (u8 *)affs_new_window(c, affs_chunkbuf) + off % (AFFS_CHUNK_WORDS * 4), n);
+	}
+}
+
+/* test/mark a block (relative to info.reserved) in the new bitmap */
+static int affs_new_test(u32 block)
+{
+	if (affs_new_bitmap)
+		return !(affs_new_bitmap[(block / 8) ^ 3] & (1 << (block & 7)));
+	return affs_chunk_test(&affs_new_chunks[block >> AFFS_CHUNK_SHIFT],
+			       block & (AFFS_CHUNK_BITS - 1));
+}
+
+/*
+ * Free space summary of the new bitmap: the # of free blocks in every
+ * bitmap block and in every group of AFFS_SUMMARY_GROUP bitmap blocks,
+ * so the allocator can skip full parts of the bitmap and the free space
+ * is known without scanning the bitmap.
+ */
+#define AFFS_SUMMARY_GROUP	16
+
+static u16 *affs_free_blk;
+static u32 *affs_free_grp;
+static u32 affs_free_cnt, affs_free_total;
+
+#if HAVE_LIBPTHREAD
+static pthread_mutex_t affs_chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*
+ * Blocks may be marked by several threads (see affs_walk_threads), so
+ * a bit of the flat bitmap is cleared atomically, which also finds a
+ * block claimed twice exactly once. Chunks are changed under a lock.
+ * Returns 1 if the block is already in use and -1 if it can't be marked,
+ * because a chunk can't grow (the first time this is reported).
+ */
+static int affs_new_use(u32 block)
+{
+	u8 *ptr;
+	u8 mask;
+	u32 i;
+	int res, nomem;
+
+	if (!affs_new_bitmap) {
+#if HAVE_LIBPTHREAD
+		pthread_mutex_lock(&affs_chunk_lock);
+#endif
+		res = affs_chunk_use(&affs_new_chunks[block >> AFFS_CHUNK_SHIFT],
+				     block & (AFFS_CHUNK_BITS - 1));
+		nomem = res < 0 ? affs_chunk_nomem++ : 0;
+#if HAVE_LIBPTHREAD
+		pthread_mutex_unlock(&affs_chunk_lock);
+#endif
+		if (res < 0) {
+			if (!nomem)
+				affs_error("unable to allocate bitmap\n");
+			affs_atomic_add(&info.errstat.bitmap_missing, 1);
+			return -1;
+		}
+		if (res)
+			return 1;
+	} else {
+		ptr = affs_new_bitmap + ((block / 8) ^ 3);
+		mask = 1 << (block & 7);
+		if (!affs_atomic_clear(ptr, mask))
+			return 1;
+	}
+
+	i = block / ((info.blocksize - 4) * 8);
+	affs_atomic_add(&affs_free_blk[i], -1);
+	affs_atomic_add(&affs_free_grp[i / AFFS_SUMMARY_GROUP], -1);
+	affs_atomic_add(&affs_free_total, -1);
+	return 0;
+}
+
+/*
+ * the reverse of affs_new_use, only used by a single thread (a block,
+ * which can't be marked as free, simply stays in use)
+ */
+static int affs_new_unuse(u32 block)
 {
 	u8 *ptr;
 	u8 mask;
+	u32 i;
+
+	if (!affs_new_bitmap) {
+		if (affs_chunk_unuse(&affs_new_chunks[block >> AFFS_CHUNK_SHIFT],
+				     block & (AFFS_CHUNK_BITS - 1)))
+			return 1;
+	} else {
+		ptr = affs_new_bitmap + ((block / 8) ^ 3);
+		mask = 1 << (block & 7);
+		if (*ptr & mask)
+			return 1;
+		*ptr |= mask;
+	}
+
+	i = block / ((info.blocksize - 4) * 8);
+	affs_free_blk[i]++;
+	affs_free_grp[i / AFFS_SUMMARY_GROUP]++;
+	affs_free_total++;
+	return 0;
+}
+
+/*
+ * Owner table: for every used block the header block it belongs to (for
+ * a header block the directory it was found in), so a cross link can be
+ * reported with both owners. It's kept in pages of AFFS_CHUNK_BITS
+ * blocks, which are only allocated when they are needed. In low memory
+ * mode there is no owner table.
+ */
+static u32 **affs_owner;
+#if HAVE_LIBPTHREAD
+static pthread_mutex_t affs_owner_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* get the owner page of block, NULL if there is none (and it can't be allocated) */
+static u32 *affs_owner_page(u32 block)
+{
+	u32 *page, c = block >> AFFS_CHUNK_SHIFT;
+
+	page = affs_atomic_load(&affs_owner[c]);
+	if (!page) {
+#if HAVE_LIBPTHREAD
+		pthread_mutex_lock(&affs_owner_lock);
+#endif
+		page = affs_owner[c];
+		if (!page) {
+			page = calloc(AFFS_CHUNK_BITS, sizeof(u32));
+			if (page)
+				affs_atomic_store(&affs_owner[c], page);
+		}
+#if HAVE_LIBPTHREAD
+		pthread_mutex_unlock(&affs_owner_lock);
+#endif
+	}
+	return page;
+}
+
+/* returns 0 if the owner of block isn't known */
+static int affs_get_owner(u32 block, u32 *owner)
+{
+	u32 *page;
+
+	if (!affs_owner)
+		return 0;
+	page = affs_atomic_load(&affs_owner[block >> AFFS_CHUNK_SHIFT]);
+	if (!page)
+		return 0;
+	*owner = affs_atomic_load(&page[block & (AFFS_CHUNK_BITS - 1)]);
+	return 1;
+}
+
+/*
+ * Cross links found during the walk of the directory tree (see
+ * affs_cross_start). With several threads the first owner of a block
+ * depends on the timing, so they are only reported after the walk,
+ * every owner against the lowest one.
+ */
+struct affs_cross {
+	u32 block;
+	u32 owner;
+};
+
+static struct affs_cross *affs_cross;
+static u32 affs_cross_cnt, affs_cross_size;
+static int affs_cross_defer;
+#if HAVE_LIBPTHREAD
+static pthread_mutex_t affs_cross_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void affs_cross_error(u32 block, u32 by, u32 owner)
+{
+	if (by && owner)
+		affs_error("block %d already allocated (by %u, again by %u)\n", block, by, owner);
+	else if (owner)
+		affs_error("block %d already allocated (again by %u)\n", block, owner);
+	else
+		affs_error("block %d already allocated\n", block);
+}
+
+/* returns 1 if the cross link has to be reported right away */
+static int affs_cross_add(u32 block, u32 owner)
+{
+	struct affs_cross *x;
+	u32 size;
+	int res = 0;
+
+	if (!affs_cross_defer)
+		return 1;
+#if HAVE_LIBPTHREAD
+	pthread_mutex_lock(&affs_cross_lock);
+#endif
+	if (affs_cross_cnt == affs_cross_size) {
+		size = affs_cross_size ? 2 * affs_cross_size : 64;
+		x = realloc(affs_cross, size * sizeof(*x));
+		if (!x) {
+			res = 1;
+			goto out;
+		}
+		affs_cross = x;
+		affs_cross_size = size;
+	}
+	x = &affs_cross[affs_cross_cnt++];
+	x->block = block;
+	x->owner = owner;
+out:
+#if HAVE_LIBPTHREAD
+	pthread_mutex_unlock(&affs_cross_lock);
+#endif
+	return res;
+}
+
+/* collect the cross links from now on instead of reporting them */
+void affs_cross_start(void)
+{
+	affs_cross_defer = 1;
+}
+
+static int affs_cmp_cross(const void *a, const void *b)
+{
+	const struct affs_cross *x = a, *y = b;
+
+	if (x->block != y->block)
+		return x->block < y->block ? -1 : 1;
+	return x->owner < y->owner ? -1 : x->owner > y->owner;
+}
+
+/*
+ * Report the collected cross links in block order. The first owner of a
+ * block is only in the owner table, every other owner is reported
+ * against the lowest of them, so the result doesn't depend on the order
+ * the blocks were claimed in.
+ */
+void affs_cross_report(void)
+{
+	struct affs_cross *x = affs_cross;
+	u32 i, j, k, block, first, by;
+	int known;
+
+	affs_cross_defer = 0;
+	if (!affs_cross_cnt)
+		return;
+	qsort(x, affs_cross_cnt, sizeof(*x), affs_cmp_cross);
+	for (i = 0; i < affs_cross_cnt; i = j) {
+		block = x[i].block;
+		for (j = i + 1; j < affs_cross_cnt && x[j].block == block; ++j)
+			;
+		known = affs_get_owner(block - info.reserved, &first);
+		by = 0;
+		k = i;
+		if (known) {
+			by = x[k].owner;
+			if (first < by) {
+				by = first;
+				known = 0;
+			} else
+				k++;
+		}
+		for (; k < j; ++k) {
+			if (known && first < x[k].owner) {
+				affs_cross_error(block, by, first);
+				known = 0;
+			}
+			affs_cross_error(block, by, x[k].owner);
+		}
+		if (known)
+			affs_cross_error(block, by, first);
+	}
+
+	free(affs_cross);
+	affs_cross = NULL;
+	affs_cross_cnt = affs_cross_size = 0;
+}
+
+/*
+ * Mark block as used by owner (0 if there is none worth mentioning).
+ * Returns 1 if the block isn't valid (or can't be marked), 2 if it was
+ * already used by another owner (a cross link) and 3 if it was used by
+ * owner itself (a loop in a chain of blocks) or its owner isn't known.
+ * An error is reported in all these cases. A block is only claimed
+ * several times by the same owner from the same thread, so the result
+ * doesn't depend on the timing of a threaded walk.
+ */
+int affs_claim_block(u32 block, u32 owner)
+{
+	u32 old, *page = NULL;
+	int res;
 
 	if (block < info.reserved || block >= info.blocks) {
 		affs_error("can't allocate block %d (block is %s)\n", block,
@@ -38,103 +694,607 @@ int affs_alloc_block(u32 block)
 		return 1;
 	}
 
+	/*
+	 * the page must exist before the block is marked, else another
+	 * thread claiming it as well could take its owner for unknown
+	 */
+	if (affs_owner)
+		page = affs_owner_page(block - info.reserved);
+	res = affs_new_use(block - info.reserved);
+	if (!res) {
+		if (owner && page)
+			affs_atomic_store(&page[(block - info.reserved) & (AFFS_CHUNK_BITS - 1)],
+					  owner);
+		return 0;
+	}
+	if (res < 0)
+		return 1;
+
+	if (!affs_get_owner(block - info.reserved, &old)) {
+		old = 0;
+		res = 3;
+	} else
+		res = old == owner ? 3 : 2;
+	if (affs_cross_add(block, owner))
+		affs_cross_error(block, old, owner);
+	return res;
+}
+
+int affs_alloc_block(u32 block)
+{
+	return affs_claim_block(block, 0) != 0;
+}
+
+static void affs_fix_bitmap(u32 start, u32 len);
+
+/*
+ * Give a block that was allocated (e.g. by affs_alloc_extent) back to
+ * the new bitmap (and the old one, see affs_alloc_extent). Returns 1 if
+ * it wasn't allocated.
+ */
+int affs_release_block(u32 block)
+{
+	u32 *page;
+
+	if (block < info.reserved || block >= info.blocks)
+		return 1;
 	block -= info.reserved;
-	ptr = affs_new_bitmap + ((block / 8) ^ 3);
-	mask = 1 << (block & 7);
+	if (affs_new_unuse(block))
+		return 1;
+	if (affs_old_bitmap)
+		affs_fix_bitmap(block, 1);
+	if (affs_owner) {
+		page = affs_owner[block >> AFFS_CHUNK_SHIFT];
+		if (page)
+			page[block & (AFFS_CHUNK_BITS - 1)] = 0;
+	}
+	return 0;
+}
 
-	if (*ptr & mask) {
-		*ptr &= ~mask;
-		return 0;
+
+#ifdef __GNUC__
+#define affs_ctz64(x)	__builtin_ctzll(x)
+#else
+static inline int affs_ctz64(u64 x)
+{
+	int n = 0;
+
+	for (; !(x & 1); x >>= 1)
+		n++;
+	return n;
+}
+#endif
+
+#ifdef __GNUC__
+#define affs_popcount64(x)	__builtin_popcountll(x)
+#else
+static inline int affs_popcount64(u64 x)
+{
+	int n = 0;
+
+	for (; x; x &= x - 1)
+		n++;
+	return n;
+}
+#endif
+
+/* 64 bits of the bitmap (starting at word w) in cpu order */
+static inline u64 affs_bitmap_dword(u32 *map, u32 w)
+{
+	return be32_to_cpu(map[w]) | (u64)be32_to_cpu(map[w + 1]) << 32;
+}
+
+/*
+ * find the first free (or used) block in [start, end) (relative to
+ * info.reserved) in bitmap, returns end if there is none.
+ */
+static u32 affs_find_bit(u8 *bitmap, u32 start, u32 end, int used)
+{
+	u32 *map = (u32 *)bitmap;
+	u32 w, last, skip;
+	u64 bits, flip;
+
+	if (start >= end)
+		return end;
+	/* words without a wanted bit, they don't need to be byte swapped */
+	skip = used ? ~0U : 0;
+	flip = used ? ~(u64)0 : 0;
+	w = (start / 64) * 2;
+	last = ((end + 63) / 64) * 2;
+	bits = (affs_bitmap_dword(map, w) ^ flip) & (~(u64)0 << (start & 63));
+	while (!bits) {
+		for (w += 2; w < last && map[w] == skip && map[w + 1] == skip; w += 2)
+			;
+		if (w >= last)
+			return end;
+		bits = affs_bitmap_dword(map, w) ^ flip;
 	}
+	start = w * 32 + affs_ctz64(bits);
+	return start < end ? start : end;
+}
 
-	affs_error("block %d already allocated\n", block + info.reserved);
-	return 1;
+#define affs_find_free(bitmap, start, end)	affs_find_bit(bitmap, start, end, 0)
+#define affs_find_used(bitmap, start, end)	affs_find_bit(bitmap, start, end, 1)
+
+/* first free bit in [start, end) of a chunk, end if there is none */
+static u32 affs_chunk_find_free(struct affs_chunk *c, u32 start, u32 end)
+{
+	u32 i;
+
+	if (start >= end)
+		return end;
+	switch (c->type) {
+	case AFFS_CHUNK_ARRAY:
+		/* skip the used blocks following start */
+		i = affs_array_find(c->u.array, c->cnt, start);
+		for (; i < c->cnt && c->u.array[i] == start; ++i)
+			start++;
+		break;
+	case AFFS_CHUNK_RUN:
+		i = affs_run_find(c->u.run, c->cnt, start);
+		if (i < c->cnt && c->u.run[i].first <= start)
+			start = c->u.run[i].last + 1;
+		break;
+	default:
+		return affs_find_free((u8 *)c->u.dense, start, end);
+	}
+	return start < end ? start : end;
 }
 
+/* first used bit in [start, end) of a chunk, end if there is none */
+static u32 affs_chunk_find_used(struct affs_chunk *c, u32 start, u32 end)
+{
+	u32 i;
 
-u32 affs_alloc_new_block(void)
+	switch (c->type) {
+	case AFFS_CHUNK_ARRAY:
+		i = affs_array_find(c->u.array, c->cnt, start);
+		if (i < c->cnt)
+			start = c->u.array[i];
+		else
+			start = end;
+		break;
+	case AFFS_CHUNK_RUN:
+		i = affs_run_find(c->u.run, c->cnt, start);
+		if (i >= c->cnt)
+			start = end;
+		else if (c->u.run[i].first > start)
+			start = c->u.run[i].first;
+		break;
+	default:
+		return affs_find_used((u8 *)c->u.dense, start, end);
+	}
+	return start < end ? start : end;
+}
+
+/* the same for the new bitmap */
+static u32 affs_new_find_range(u32 start, u32 end)
 {
-	u32 i, last, block = info.lastalloc - info.reserved;
-	u8 mask, byte;
-	u8 *ptr;
+	u32 c, base, last, block;
 
-	last = info.blocks - info.reserved;
-	i = block & 7;
-	if (i) {
-		block &= -8;
-		ptr = affs_new_bitmap + ((block / 8) ^ 3);
-		if ((byte = *ptr)) {
-			mask = 1 << i;
-			goto into_loop;
+	if (affs_new_bitmap)
+		return affs_find_free(affs_new_bitmap, start, end);
+	for (; start < end; start = base + AFFS_CHUNK_BITS) {
+		c = start >> AFFS_CHUNK_SHIFT;
+		base = c << AFFS_CHUNK_SHIFT;
+		if (affs_new_chunks[c].used == AFFS_CHUNK_BITS)
+			continue;
+		last = end - base < AFFS_CHUNK_BITS ? end - base : AFFS_CHUNK_BITS;
+		block = affs_chunk_find_free(&affs_new_chunks[c], start - base, last);
+		if (block < last)
+			return base + block;
+	}
+	return end;
+}
+
+/* the same, but full bitmap blocks (or groups of them) are skipped */
+static u32 affs_new_find_free(u32 start, u32 end)
+{
+	u32 bits = (info.blocksize - 4) * 8;
+	u32 i, block;
+	u64 last;
+
+	while (start < end) {
+		i = start / bits;
+		if (!affs_free_grp[i / AFFS_SUMMARY_GROUP]) {
+			last = (u64)(i / AFFS_SUMMARY_GROUP + 1) * AFFS_SUMMARY_GROUP * bits;
+		} else {
+			last = (u64)(i + 1) * bits;
+			if (last > end)
+				last = end;
+			if (affs_free_blk[i]) {
+				block = affs_new_find_range(start, last);
+				if (block < last)
+					return block;
+			}
 		}
+		if (last >= end)
+			break;
+		start = last;
 	}
-again:
-	for (; block < last; block += 8) {
-		ptr = affs_new_bitmap + ((block / 8) ^ 3);
-		if (!(byte = *ptr))
-			continue;
-		mask = 1;
-		i = 0;
-	into_loop:
-		for (; i < 8; mask <<= 1, ++i) {
-			if ((byte & mask) && (block + i < last))
-				goto done;
+	return end;
+}
+
+/* recount the free blocks of the new bitmap for the summary */
+static void affs_count_free(void)
+{
+	u32 bits = (info.blocksize - 4) * 8;
+	u32 i, w, c, x, cnt, *map = NULL;
+	u64 end, size = info.blocks - info.reserved;
+
+	memset(affs_free_grp, 0, ((affs_free_cnt + AFFS_SUMMARY_GROUP - 1) / AFFS_SUMMARY_GROUP) * sizeof(u32));
+	affs_free_total = 0;
+	c = ~0U;
+	for (i = 0; i < affs_free_cnt; ++i) {
+		end = (u64)(i + 1) * bits;
+		if (end > size)
+			end = size;
+		cnt = 0;
+		for (w = i * (bits / 32); (u64)w * 32 < end; ++w) {
+			if (w / AFFS_CHUNK_WORDS != c) {
+				c = w / AFFS_CHUNK_WORDS;
+				map = affs_new_window(c, affs_chunkbuf);
+			}
+			x = be32_to_cpu(map[w % AFFS_CHUNK_WORDS]);
+			if ((u64)w * 32 + 32 > end)
+				x &= (1U << (end & 31)) - 1;
+			cnt += affs_popcount64(x);
 		}
+		affs_free_blk[i] = cnt;
+		affs_free_grp[i / AFFS_SUMMARY_GROUP] += cnt;
+		affs_free_total += cnt;
 	}
-	if (last == info.blocks - info.reserved) {
+}
+
+/* first used block in [start, end) of the new bitmap, end if there is none */
+static u32 affs_new_find_used(u32 start, u32 end)
+{
+	u32 c, base, last, block;
+
+	if (affs_new_bitmap)
+		return affs_find_used(affs_new_bitmap, start, end);
+	for (; start < end; start = base + AFFS_CHUNK_BITS) {
+		c = start >> AFFS_CHUNK_SHIFT;
+		base = c << AFFS_CHUNK_SHIFT;
+		if (!affs_new_chunks[c].used)
+			continue;
+		last = end - base < AFFS_CHUNK_BITS ? end - base : AFFS_CHUNK_BITS;
+		block = affs_chunk_find_used(&affs_new_chunks[c], start - base, last);
+		if (block < last)
+			return base + block;
+	}
+	return end;
+}
+
+/* # of free blocks according to the new bitmap */
+u32 affs_free_blocks(void)
+{
+	return affs_free_total;
+}
+
+u32 affs_alloc_new_block(void)
+{
+	u32 block, last;
+
+	/* a block might still be in use by a part of the tree not checked */
+	if (info.errstat.bitmap_missing)
+		return 0;
+	last = info.blocks - info.reserved;
+	block = affs_new_find_free(info.lastalloc - info.reserved, last);
+	if (block == last) {
+		/* wrap around and search the blocks before the root block */
 		last = info.root - info.reserved;
-		goto again;
+		block = affs_new_find_free(0, last);
+		if (block == last)
+			return 0;
 	}
-	return 0;
-done:
-	*ptr = byte ^ mask;
-	block += i + info.reserved;
+	if (affs_new_use(block))
+		return 0;
+	block += info.reserved;
 	info.lastalloc = block;
-	return block; 
+	return block;
 }
 
-int affs_test_block(u32 block)
+/*
+ * Allocate up to count contiguous blocks near goal (info.lastalloc if 0).
+ * Like affs_alloc_new_block, the blocks from goal to the end of the
+ * volume are searched first, then the ones before the root block. The
+ * first free run of count blocks is taken, if there is none, the
+ * longest one found. Returns the first block and the # of allocated
+ * blocks in len, or 0 if there are no free blocks (or the new bitmap
+ * is incomplete).
+ * If there is an old bitmap, the blocks must be free in it too, as a
+ * block the walk didn't reach might still be in use. The allocated
+ * blocks are taken over into the old bitmap, so they aren't reported
+ * as a mismatch by affs_cmp_bitmap and their bitmap blocks are written.
+ */
+u32 affs_alloc_extent(u32 goal, u32 count, u32 *len)
 {
-	u8 *ptr;
-	u8 mask;
+	u32 range[2][2], best, bestlen, start, end, i;
+	u64 last;
+
+	*len = 0;
+	if (!count || info.errstat.bitmap_missing)
+		return 0;
+	if (!goal)
+		goal = info.lastalloc;
+	if (goal < info.reserved || goal >= info.blocks)
+		goal = info.root;
+	range[0][0] = goal - info.reserved;
+	range[0][1] = info.blocks - info.reserved;
+	range[1][0] = 0;
+	range[1][1] = info.root - info.reserved;
 
+	best = bestlen = 0;
+	for (i = 0; i < 2 && bestlen < count; ++i) {
+		for (start = range[i][0]; start < range[i][1]; start = end) {
+			start = affs_new_find_free(start, range[i][1]);
+			if (start >= range[i][1])
+				break;
+			if (affs_old_bitmap) {
+				end = affs_find_free(affs_old_bitmap, start, range[i][1]);
+				if (end != start)
+					continue;
+			}
+			/* only the first count blocks of a run are of interest */
+			last = (u64)start + count;
+			if (last > range[i][1])
+				last = range[i][1];
+			end = affs_new_find_used(start, last);
+			if (affs_old_bitmap)
+				end = affs_find_used(affs_old_bitmap, start, end);
+			if (end - start > bestlen) {
+				best = start;
+				bestlen = end - start;
+				if (bestlen == count)
+					break;
+			}
+		}
+	}
+	if (!bestlen)
+		return 0;
+
+	for (i = 0; i < bestlen; ++i) {
+		if (affs_new_use(best + i)) {
+			while (i > 0)
+				affs_new_unuse(best + --i);
+			return 0;
+		}
+	}
+	if (affs_old_bitmap)
+		affs_fix_bitmap(best, bestlen);
+	*len = bestlen;
+	info.lastalloc = best + bestlen - 1 + info.reserved;
+	return best + info.reserved;
+}
+
+int affs_test_block(u32 block)
+{
 	if (block < info.reserved || block >= info.blocks)
 		return 1;
 
-	block -= info.reserved;
-	ptr = affs_new_bitmap + ((block / 8) ^ 3);
-	mask = 1 << (block & 7);
+	return affs_new_test(block - info.reserved);
+}
 
-	if (*ptr & mask)
-		return 0;
 
-	return 1;
+/* allocate the bitmaps (all blocks free) and the bitmap block list */
+static int affs_alloc_bitmap(u32 bitmap_blocks)
+{
+	u32 size = bitmap_blocks * info.blocksize;
+
+	affs_new_bitmap = NULL;
+	affs_new_chunks = NULL;
+	if (info.blocks - info.reserved <= AFFS_FLAT_MAX) {
+		affs_new_bitmap = malloc(size);
+	} else {
+		/* all chunks are empty arrays, i.e. all blocks are free */
+		affs_chunk_cnt = (info.blocks - info.reserved + AFFS_CHUNK_BITS - 1) >> AFFS_CHUNK_SHIFT;
+		affs_new_chunks = calloc(affs_chunk_cnt, sizeof(*affs_new_chunks));
+		memset(affs_chunk_free, 0xff, sizeof(affs_chunk_free));
+	}
+	/* in low memory mode the old bitmap is reread by affs_cmp_bitmap */
+	affs_old_bitmap = info.lowmem ? NULL : malloc(size);
+	affs_bitmap_blk = calloc(bitmap_blocks, sizeof(u32));
+	affs_free_blk = malloc(bitmap_blocks * sizeof(u16));
+	affs_free_grp = malloc((bitmap_blocks + AFFS_SUMMARY_GROUP - 1) / AFFS_SUMMARY_GROUP * sizeof(u32));
+	affs_owner = info.lowmem ? NULL :
+		calloc((info.blocks - info.reserved + AFFS_CHUNK_BITS - 1) >> AFFS_CHUNK_SHIFT,
+		       sizeof(*affs_owner));
+	if ((!affs_old_bitmap && !info.lowmem) || (!affs_new_bitmap && !affs_new_chunks) ||
+	    (!affs_owner && !info.lowmem) ||
+	    !affs_bitmap_blk || !affs_free_blk || !affs_free_grp) {
+		affs_error("unable to allocate bitmap\n");
+		return 1;
+	}
+	if (affs_old_bitmap)
+		memset(affs_old_bitmap, 0xff, size);
+	if (affs_new_bitmap)
+		memset(affs_new_bitmap, 0xff, size);
+	affs_bitmap_cnt = 0;
+	affs_free_cnt = bitmap_blocks;
+	affs_count_free();
+	return 0;
+}
+
+/* add cnt bitmap blocks (listed in blk) to the bitmap block list */
+static void affs_add_bitmap_blocks(u32 *blk, u32 cnt)
+{
+	u32 i;
+
+	/* the kernel can already read them, while we walk the extension blocks */
+	affs_bprefetch(blk, cnt);
+	for (i = 0; i < cnt; ++i)
+		affs_bitmap_blk[affs_bitmap_cnt++] = be32_to_cpu(blk[i]);
 }
 
+/*
+ * The bitmap blocks are loaded by several workers, each one reads,
+ * checks and copies a part of the bitmap block list. The blocks are
+ * marked as allocated afterwards, so the new bitmap is only modified
+ * by a single thread. Read errors are collected in the output of the
+ * worker and printed in list order.
+ */
+struct affs_bitmap_load {
+	/* part of the bitmap block list [first, first + cnt) */
+	u32 first, cnt;
+	/* buffer for AFFS_RUN_MAX blocks */
+	u8 *buf;
+	/* destination for the bitmap data (if NULL, blocks are only checked) */
+	u8 *dst;
+	/* set for every valid bitmap block */
+	u8 *valid;
+	struct affs_output out;
+#if HAVE_LIBPTHREAD
+	pthread_t thread;
+	int started;
+#endif
+};
+
+static void *affs_load_bitmap_blocks(void *arg)
+{
+	struct affs_bitmap_load *load = arg;
+	u32 i, j, n, block, end, single;
+	u8 *buf;
+
+	affs_set_output(&load->out);
+	end = load->first + load->cnt;
+	single = 0;
+	for (i = load->first; i < end; i += n) {
+		/* consecutive blocks are read with a single request */
+		block = affs_bitmap_blk[i];
+		for (n = 1; i >= single && i + n < end && n < AFFS_RUN_MAX; ++n)
+			if (affs_bitmap_blk[i + n] != block + n)
+				break;
+		buf = affs_bget_run(load->buf, block, n);
+		if (!buf) {
+			if (n > 1) {
+				/* retry block by block to find the bad one */
+				single = i + n;
+				n = 0;
+			}
+			continue;
+		}
+		for (j = 0; j < n; ++j, buf += info.blocksize) {
+			if (affs_checksum(buf))
+				continue;
+			if (load->dst)
+				memcpy(load->dst + (i + j - load->first) * (info.blocksize - 4),
+				       buf + 4, info.blocksize - 4);
+			load->valid[i + j - load->first] = 1;
+		}
+	}
+	affs_set_output(NULL);
+	return NULL;
+}
+
+/* load all blocks of the bitmap block list into affs_old_bitmap (if there is one) */
+static int affs_load_bitmap(void)
+{
+	struct affs_bitmap_load load[AFFS_THREADS_MAX];
+	u32 i, n, chunk, block;
+	u8 *valid;
 
+	valid = calloc(affs_bitmap_cnt + 1, 1);
+	if (!valid) {
+		affs_error("unable to allocate bitmap\n");
+		return 1;
+	}
+
+	/* every worker gets at least a full run */
+	n = 1;
+#if HAVE_LIBPTHREAD
+	n = (affs_bitmap_cnt + AFFS_RUN_MAX - 1) / AFFS_RUN_MAX;
+	if (n > info.threads)
+		n = info.threads;
+	if (n > AFFS_THREADS_MAX)
+		n = AFFS_THREADS_MAX;
+	if (n < 1)
+		n = 1;
+#endif
+	load[0].buf = affs_runbuf;
+	for (i = 1; i < n; ++i) {
+		load[i].buf = malloc(AFFS_RUN_MAX * info.blocksize);
+		if (!load[i].buf)
+			break;
+	}
+	/* fewer workers, if we're short of memory */
+	n = i;
+	chunk = (affs_bitmap_cnt + n - 1) / n;
+	for (i = 0; i < n; ++i) {
+		load[i].first = i * chunk;
+		load[i].cnt = 0;
+		if (load[i].first < affs_bitmap_cnt)
+			load[i].cnt = affs_bitmap_cnt - load[i].first;
+		if (load[i].cnt > chunk)
+			load[i].cnt = chunk;
+		load[i].dst = NULL;
+		if (affs_old_bitmap)
+			load[i].dst = affs_old_bitmap + load[i].first * (info.blocksize - 4);
+		load[i].valid = valid + load[i].first;
+		memset(&load[i].out, 0, sizeof(load[i].out));
+	}
+
+#if HAVE_LIBPTHREAD
+	for (i = 1; i < n; ++i)
+		load[i].started = !pthread_create(&load[i].thread, NULL,
+						  affs_load_bitmap_blocks, &load[i]);
+#endif
+	affs_load_bitmap_blocks(&load[0]);
+	for (i = 1; i < n; ++i) {
+#if HAVE_LIBPTHREAD
+		if (load[i].started)
+			pthread_join(load[i].thread, NULL);
+		else
+#endif
+			affs_load_bitmap_blocks(&load[i]);
+		free(load[i].buf);
+	}
+	for (i = 0; i < n; ++i) {
+		if (load[i].out.len)
+			affs_write(load[i].out.buf, load[i].out.len);
+		free(load[i].out.buf);
+	}
+
+	for (i = 0; i < affs_bitmap_cnt; ++i) {
+		block = affs_bitmap_blk[i];
+		if (!valid[i]) {
+			info.errstat.bitmap_block++;
+			continue;
+		}
+		affs_alloc_block(block);
+		affs_print(2, "read bitmap %d: %u\n", i, block);
+	}
+	free(valid);
+	return 0;
+}
+
+/*
+ * Read the bitmap: first the locations of all bitmap blocks are
+ * collected from the root block and the chain of extension blocks,
+ * then all bitmap blocks are loaded at once.
+ */
 int affs_read_bitmap(void)
 {
 	struct affs_root_tail *tail = AFFS_ROOT_TAIL(affs_rootbuf);
 	u32 bitmap_blocks, blocks, bits;
 	u32 extmap[AFFS_BLOCKSIZE_MAX/4];
-	u32 ext, i, size;
-	u8 *ptr;
+	u32 ext;
+	int err = 0;
 
 	/* bit number in bitmap block */
 	bits = (info.blocksize - 4) * 8;
 	/* # of bitmap blocks */
 	bitmap_blocks = (info.blocks - info.reserved + bits - 1) / bits;
-	size = bitmap_blocks * info.blocksize;
 
-	affs_new_bitmap = malloc(size);
-	affs_old_bitmap = malloc(size);
-	if (!affs_old_bitmap || !affs_new_bitmap) {
+	if (affs_alloc_bitmap(bitmap_blocks))
+		return 1;
+
+	/* only bitmap blocks fixed by affs_cmp_bitmap need to be written */
+	affs_bitmap_dirty = calloc(bitmap_blocks, 1);
+	if (!affs_bitmap_dirty) {
 		affs_error("unable to allocate bitmap\n");
 		return 1;
 	}
-	memset(affs_old_bitmap, 0xff, size);
-	memset(affs_new_bitmap, 0xff, size);
-	ptr = affs_old_bitmap;
 
 	affs_alloc_block(info.root);
 	info.lastalloc = info.root;
@@ -142,26 +1302,11 @@ int affs_read_bitmap(void)
 	blocks = AFFS_ROOT_BMAPS;
 	if (bitmap_blocks < AFFS_ROOT_BMAPS)
 		blocks = bitmap_blocks;
-	for (i = 0; i < blocks; ptr += info.blocksize - 4, ++i) {
-		if (affs_bread(affs_databuf, be32_to_cpu(tail->bitmap_blk[i]))) {
-			info.errstat.bitmap_block++;
-			continue;
-		}
-		if (affs_checksum(affs_databuf)) {
-			info.errstat.bitmap_block++;
-			continue;
-		}
-		affs_alloc_block(be32_to_cpu(tail->bitmap_blk[i]));
-		affs_print(2, "read bitmap %d : %d\n", i, be32_to_cpu(tail->bitmap_blk[i]));
-		memcpy(ptr, affs_databuf + 4, info.blocksize - 4);
-	}
-
-	if (bitmap_blocks <= AFFS_ROOT_BMAPS)
-		return 0;
-	bitmap_blocks -= AFFS_ROOT_BMAPS;
+	affs_add_bitmap_blocks(tail->bitmap_blk, blocks);
+	bitmap_blocks -= blocks;
 
 	ext = be32_to_cpu(tail->bitmap_ext); 
-	while (ext) {
+	while (ext && bitmap_blocks) {
 		if (affs_bread(extmap, ext)) {
 			info.errstat.bitmap_block++;
 			break;
@@ -172,152 +1317,313 @@ int affs_read_bitmap(void)
 		blocks = (info.blocksize - 4) / 4;
 		if (bitmap_blocks < blocks)
 			blocks = bitmap_blocks;
-		for (i = 0; i < blocks; ptr += info.blocksize - 4, ++i) {
-			if (affs_bread(affs_databuf, be32_to_cpu(extmap[i]))) {
-				info.errstat.bitmap_block++;
-				continue;
-			}
-			if (affs_checksum(affs_databuf)) {
-				info.errstat.bitmap_block++;
-				continue;
-			}
-			affs_alloc_block(be32_to_cpu(extmap[i]));
-			affs_print(2, "read bitmap %d: %u\n", i, be32_to_cpu(extmap[i]));
-			memcpy(ptr, affs_databuf + 4, info.blocksize - 4);
-		}
+		/* next extension block */
+		affs_bprefetch(extmap + blocks, 1);
+		affs_add_bitmap_blocks(extmap, blocks);
 
-		ext = be32_to_cpu(extmap[i]);
-		if (!ext && bitmap_blocks > blocks) {
-			affs_error("bitmap blocks missing\n");
-			info.errstat.bitmap_block++;
-			return 1;
-		}
+		ext = be32_to_cpu(extmap[blocks]);
 		bitmap_blocks -= blocks;
 	}
+	if (bitmap_blocks && !info.errstat.bitmap_block) {
+		affs_error("bitmap blocks missing\n");
+		info.errstat.bitmap_block++;
+		err = 1;
+	}
 
-	return 0;
+	err |= affs_load_bitmap();
+	/* the bitmap is complete now, so start with an exact summary */
+	affs_count_free();
+	return err || affs_chunk_nomem;
 }
 
-static void inline affs_set_bitmap_checksum(void *data)
-{
-	u32 *buf = data;
-
-	*buf = 0;
-	*buf = cpu_to_be32(-affs_checksum(buf));
-}
+#define affs_bitmap_isdirty(i)	(!affs_bitmap_dirty || affs_bitmap_dirty[i])
 
+/*
+ * Write the changed bitmap blocks, consecutive blocks are written with
+ * a single request. The checksum is put in front of the bitmap data
+ * with an iovec, so the bitmap isn't copied.
+ */
 int affs_write_bitmap(void)
 {
 	struct affs_root_tail *tail = AFFS_ROOT_TAIL(affs_rootbuf);
-	u32 bitmap_blocks, blocks, bits;
-	u32 extmap[AFFS_BLOCKSIZE_MAX/4];
-	u32 ext, i;
+	struct iovec iov[2 * AFFS_RUN_MAX];
+	u32 chksum[AFFS_RUN_MAX];
+	u32 i, j, n, block, size;
 	u8 *ptr;
 
 	if (info.errstat.bitmap_block) {
 		affs_error("error in bitmap. abort writing bitmap\n");
 		return 1;
 	}
-
-	/* bit number in bitmap block */
-	bits = (info.blocksize - 4) * 8;
-	/* # of bitmap blocks */
-	bitmap_blocks = (info.blocks - info.reserved + bits - 1) / bits;
-
-	ptr = affs_new_bitmap;
-	blocks = AFFS_ROOT_BMAPS;
-	if (bitmap_blocks < AFFS_ROOT_BMAPS)
-		blocks = bitmap_blocks;
-	for (i = 0; i < blocks; ptr += info.blocksize - 4, ++i) {
-		memcpy(affs_databuf + 4, ptr, info.blocksize - 4);
-		affs_set_bitmap_checksum(affs_databuf);
-		affs_print(2, "write bitmap %d : %d\n", i, be32_to_cpu(tail->bitmap_blk[i]));
-		affs_bwrite(affs_databuf, be32_to_cpu(tail->bitmap_blk[i]));
+	if (info.errstat.bitmap_missing) {
+		affs_error("new bitmap is incomplete. abort writing bitmap\n");
+		return 1;
 	}
 
-	if (bitmap_blocks <= AFFS_ROOT_BMAPS)
-		goto done;
-	bitmap_blocks -= AFFS_ROOT_BMAPS;
-
-	ext = be32_to_cpu(tail->bitmap_ext);
-	while (ext) {
-		if (affs_bread(extmap, ext))
-			break;
-		blocks = (info.blocksize - 4) / 4;
-		if (bitmap_blocks < blocks)
-			blocks = bitmap_blocks;
-		for (i = 0; i < blocks; ptr += info.blocksize - 4, ++i) {
-			memcpy(affs_databuf + 4, ptr, info.blocksize - 4);
-			affs_set_bitmap_checksum(affs_databuf);
-			affs_print(2, "write bitmap %d: %u\n", i, be32_to_cpu(extmap[i]));
-			affs_bwrite(affs_databuf, be32_to_cpu(extmap[i]));
+	size = info.blocksize - 4;
+	for (i = 0; i < affs_bitmap_cnt; i += n) {
+		n = 1;
+		if (!affs_bitmap_isdirty(i))
+			continue;
+		block = affs_bitmap_blk[i];
+		while (i + n < affs_bitmap_cnt && n < AFFS_RUN_MAX &&
+		       affs_bitmap_blk[i + n] == block + n && affs_bitmap_isdirty(i + n))
+			n++;
+		for (j = 0; j < n; ++j) {
+			if (affs_new_bitmap) {
+				ptr = affs_new_bitmap + (i + j) * size;
+			} else {
+				ptr = affs_streambuf + j * size;
+				affs_new_copy(ptr, (i + j) * size, size);
+			}
+			chksum[j] = cpu_to_be32(-affs_checksum_words(ptr, size / 4));
+			iov[2 * j].iov_base = &chksum[j];
+			iov[2 * j].iov_len = 4;
+			iov[2 * j + 1].iov_base = ptr;
+			iov[2 * j + 1].iov_len = size;
+			affs_print(2, "write bitmap %d: %u\n", i + j, block + j);
 		}
-
-		ext = be32_to_cpu(extmap[i]);
-		if (bitmap_blocks <= blocks)
-			break;
-		bitmap_blocks -= blocks;
+		if (affs_bwritev(iov, 2 * n, block, n))
+			return 1;
 	}
 
-done:
 	tail->bitmap_flag = cpu_to_be32(-1);
 	return 0;
 }
 
-u32 affs_cmp_bitmap(void)
+/* copy the bits of the blocks [start, start + len) from the new bitmap to dst */
+static void affs_copy_bitmap(u8 *dst, u32 start, u32 len)
 {
-	u32 i, size, block, err;
-	u8 mask;
+	u32 *d = (u32 *)dst, *s = NULL;
+	u32 w, c, end, mask;
+
+	c = ~0U;
+	for (end = start + len; start < end; start = (w + 1) * 32) {
+		w = start / 32;
+		if (w / AFFS_CHUNK_WORDS != c) {
+			c = w / AFFS_CHUNK_WORDS;
+			s = affs_new_window(c, affs_fixbuf);
+		}
+		mask = ~0U << (start & 31);
+		if (end < (w + 1) * 32)
+			mask &= ~0U >> (32 - (end & 31));
+		mask = cpu_to_be32(mask);
+		d[w] = (d[w] & ~mask) | (s[w % AFFS_CHUNK_WORDS] & mask);
+	}
+}
+
+/*
+ * Fix the bitmap for the blocks [start, start + len): the range is taken
+ * over from the new into the old bitmap and the bitmap blocks covering
+ * it are marked to be written.
+ */
+static void affs_fix_bitmap(u32 start, u32 len)
+{
+	u32 bits = (info.blocksize - 4) * 8;
+	u32 i;
+
+	if (affs_old_bitmap)
+		affs_copy_bitmap(affs_old_bitmap, start, len);
+	if (!affs_bitmap_dirty)
+		return;
+	for (i = start / bits; i <= (start + len - 1) / bits; ++i)
+		affs_bitmap_dirty[i] = 1;
+}
+
+/*
+ * Mismatches between the bitmaps are collected into extents of the
+ * same kind, which are printed as "<first-last>" for blocks in use but
+ * not marked as allocated and "{first-last}" for blocks not in use but
+ * marked as allocated.
+ */
+struct affs_extent {
+	u32 start;
+	u32 len;
+	int free;
+};
+
+static u32 affs_extent_cnt[2];
+
+static void affs_flush_extent(struct affs_extent *ext)
+{
+	u32 start = ext->start + info.reserved;
+
+	if (!ext->len)
+		return;
+	affs_extent_cnt[ext->free]++;
+	if (ext->len == 1)
+		affs_print(2, ext->free ? "{%u} " : "<%u> ", start);
+	else
+		affs_print(2, ext->free ? "{%u-%u} " : "<%u-%u> ", start, start + ext->len - 1);
+	if (info.write)
+		affs_fix_bitmap(ext->start, ext->len);
+	ext->len = 0;
+}
+
+static void affs_add_extent(struct affs_extent *ext, u32 start, u32 len, int free)
+{
+	if (ext->len && ext->start + ext->len == start && ext->free == free) {
+		ext->len += len;
+		return;
+	}
+	affs_flush_extent(ext);
+	ext->start = start;
+	ext->len = len;
+	ext->free = free;
+}
+
+/*
+ * compare the words [w, end) of the new bitmap with old (which starts
+ * with word w of the old bitmap), returns the # of mismatches.
+ */
+static u32 affs_cmp_words(u32 *old, u32 w, u32 end, struct affs_extent *ext)
+{
+	u32 *new = NULL;
+	u32 i, j, c, last, size, bit, run, err;
+	u64 diff, free, same;
 
-	affs_print(2, "bitmap check: ");
 	err = 0;
-	size = (info.blocks - info.reserved - 1) / 8;
-	for (i = 0; i <= size; ++i) {
-		mask = affs_new_bitmap[i ^ 3] ^ affs_old_bitmap[i ^ 3];
-		if (!mask)
+	size = info.blocks - info.reserved;
+	last = ((size + 63) / 64) * 2;
+	c = ~0U;
+	for (i = 0; w < end; w += 2, i += 2) {
+		/* the chunks contain an even number of words */
+		if (w / AFFS_CHUNK_WORDS != c) {
+			c = w / AFFS_CHUNK_WORDS;
+			new = affs_new_window(c, affs_chunkbuf);
+		}
+		j = w % AFFS_CHUNK_WORDS;
+		/* equal words are equal in any byte order */
+		if (new[j] == old[i] && new[j + 1] == old[i + 1])
 			continue;
+		free = affs_bitmap_dword(new, j);
+		diff = free ^ affs_bitmap_dword(old, i);
+		if (w + 2 >= last && (size & 63))
+			diff &= ~(~(u64)0 << (size & 63));
 
-		if (i == size)
-			mask &= 0xff >> (8 - ((info.blocks - info.reserved) & 7));
-
-		for (block = i * 8; mask; ++block, mask >>= 1) {
-			if (mask & 1) {
-				if (affs_test_block(block + info.reserved)) {
-					affs_print(2, "<%d> ", block + info.reserved);
-					info.errstat.bitmap_alloc++;
-				} else {
-					affs_print(2, "{%d} ", block + info.reserved);
-					info.errstat.bitmap_free++;
-				}
-				err++;
-			}
+		info.errstat.bitmap_free += affs_popcount64(diff & free);
+		info.errstat.bitmap_alloc += affs_popcount64(diff & ~free);
+		err += affs_popcount64(diff);
+
+		while (diff) {
+			bit = affs_ctz64(diff);
+			/* length of the run of mismatches of the same kind */
+			same = diff & ((free >> bit) & 1 ? free : ~free);
+			same = ~(same >> bit);
+			run = same ? affs_ctz64(same) : 64;
+			affs_add_extent(ext, w * 32 + bit, run, (free >> bit) & 1);
+			if (run < 64)
+				diff &= ~((((u64)1 << run) - 1) << bit);
+			else
+				diff = 0;
 		}
 	}
+	return err;
+}
+
+/*
+ * Without the old bitmap, the bitmap blocks are read again, AFFS_RUN_MAX
+ * blocks at a time. That's an even number, so every part starts at a
+ * 64 bit boundary.
+ */
+static u32 affs_cmp_bitmap_stream(u32 last, struct affs_extent *ext)
+{
+	struct affs_bitmap_load load;
+	u8 valid[AFFS_RUN_MAX];
+	u32 i, n, w, end, words, blocks, err;
+
+	err = 0;
+	words = (info.blocksize - 4) / 4;
+	blocks = (last + words - 1) / words;
+	load.buf = affs_runbuf;
+	load.dst = affs_streambuf;
+	load.valid = valid;
+	memset(&load.out, 0, sizeof(load.out));
+	for (i = 0; i < blocks; i += n) {
+		n = blocks - i;
+		if (n > AFFS_RUN_MAX)
+			n = AFFS_RUN_MAX;
+		/* invalid or missing blocks are all free, like in affs_read_bitmap */
+		memset(affs_streambuf, 0xff, n * (info.blocksize - 4));
+		load.first = i;
+		load.cnt = 0;
+		if (i < affs_bitmap_cnt)
+			load.cnt = affs_bitmap_cnt - i < n ? affs_bitmap_cnt - i : n;
+		affs_load_bitmap_blocks(&load);
+		if (load.out.len)
+			affs_write(load.out.buf, load.out.len);
+		load.out.len = load.out.line = 0;
+
+		w = i * words;
+		end = (i + n) * words;
+		if (end > last)
+			end = last;
+		err += affs_cmp_words((u32 *)affs_streambuf, w, end, ext);
+	}
+	free(load.out.buf);
+	return err;
+}
+
+u32 affs_cmp_bitmap(void)
+{
+	struct affs_extent ext;
+	u32 last, err;
+
+	affs_print(2, "bitmap check: ");
+	ext.len = 0;
+	affs_extent_cnt[0] = affs_extent_cnt[1] = 0;
+	last = ((info.blocks - info.reserved + 63) / 64) * 2;
+	if (affs_old_bitmap)
+		err = affs_cmp_words((u32 *)affs_old_bitmap, 0, last, &ext);
+	else
+		err = affs_cmp_bitmap_stream(last, &ext);
+	affs_flush_extent(&ext);
 	affs_print(2, "\n");
+
+	if (err)
+		affs_print(1, "bitmap: %u blocks (%u extents) not marked as allocated, "
+			   "%u blocks (%u extents) not marked as free\n",
+			   info.errstat.bitmap_alloc, affs_extent_cnt[0],
+			   info.errstat.bitmap_free, affs_extent_cnt[1]);
+	if (affs_new_chunks)
+		affs_chunk_stat();
 	return err;
 }
 
+/* allocate cnt bitmap blocks (as few runs as possible) and list them in blk */
+static int affs_alloc_bitmap_blocks(u32 *blk, u32 cnt)
+{
+	u32 i, j, new, len;
+
+	for (i = 0; i < cnt; i += len) {
+		new = affs_alloc_extent(0, cnt - i, &len);
+		if (!new) {
+			affs_error("no space for the bitmap\n");
+			return 1;
+		}
+		for (j = 0; j < len; ++j) {
+			affs_print(2, "alloc bitmap %d at %d\n", i + j, new + j);
+			blk[i + j] = cpu_to_be32(new + j);
+			affs_bitmap_blk[affs_bitmap_cnt++] = new + j;
+		}
+	}
+	return 0;
+}
+
 int affs_create_bitmap(void)
 {
 	struct affs_root_tail *tail = AFFS_ROOT_TAIL(affs_rootbuf);
 	u32 bitmap_blocks, blocks, bits;
 	u32 extmap[AFFS_BLOCKSIZE_MAX/4];
-	u32 ext, i, new, size;
+	u32 ext, new;
 
 	/* bit number in bitmap block */
 	bits = (info.blocksize - 4) * 8;
 	/* # of bitmap blocks */
 	bitmap_blocks = (info.blocks - info.reserved + bits - 1) / bits;
-	size = bitmap_blocks * info.blocksize;
 
-	affs_new_bitmap = malloc(size);
-	affs_old_bitmap = malloc(size);
-	if (!affs_old_bitmap || !affs_new_bitmap) {
-		affs_error("unable to allocate bitmap\n");
+	if (affs_alloc_bitmap(bitmap_blocks))
 		return 1;
-	}
-	memset(affs_old_bitmap, 0xff, size);
-	memset(affs_new_bitmap, 0xff, size);
 
 	affs_alloc_block(info.root);
 	info.lastalloc = info.root;
@@ -326,11 +1632,8 @@ int affs_create_bitmap(void)
 	if (bitmap_blocks < AFFS_ROOT_BMAPS)
 		blocks = bitmap_blocks;
 
-	for (i = 0; i < blocks; ++i) {
-		new = affs_alloc_new_block();
-		affs_print(2, "alloc bitmap %d at %d\n", i, new);
-		tail->bitmap_blk[i] = cpu_to_be32(new);
-	}
+	if (affs_alloc_bitmap_blocks(tail->bitmap_blk, blocks) || affs_chunk_nomem)
+		return 1;
 
 	if (bitmap_blocks <= AFFS_ROOT_BMAPS)
 		return 0;
@@ -346,17 +1649,14 @@ int affs_create_bitmap(void)
 
 		if (bitmap_blocks < blocks)
 			blocks = bitmap_blocks;
-		for (i = 0; i < blocks; ++i) {
-			new = affs_alloc_new_block();
-			affs_print(2, "alloc bitmap %d at %d\n", i, new);
-			extmap[i] = cpu_to_be32(new);
-		}
+		if (affs_alloc_bitmap_blocks(extmap, blocks))
+			return 1;
 
                 bitmap_blocks -= blocks;
                 if (bitmap_blocks != 0) {
                     new = affs_alloc_new_block();
                     affs_print(2, "alloc ext bitmap at %d\n", new);
-                    extmap[i] = cpu_to_be32(new);
+                    extmap[blocks] = cpu_to_be32(new);
                 }
 		affs_bwrite(extmap, ext);
                 ext = new;
@@ -18,7 +18,16 @@
 
 #include "affs_config.h"
 
+#include <sys/types.h>
+#include <sys/uio.h>
+#if HAVE_MMAP
+#include <sys/mman.h>
+#endif
+#if HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -30,70 +39,601 @@
 u8 affs_rootbuf[AFFS_BLOCKSIZE_MAX];
 u8 affs_databuf[AFFS_BLOCKSIZE_MAX];
 
-int affs_bread(void *data, u32 block)
+/* memory mapped device (see affs_map_device) */
+static u8 *affs_map;
+static off_t affs_mapsize;
+static int affs_mapwrite;
+
+/*
+ * Set the blocksize and the values derived from it, returns 1 if size
+ * isn't a valid blocksize.
+ */
+int affs_set_blocksize(u32 size)
 {
-	int res;
+	u32 shift;
 
-	if (block < info.reserved) {
-		affs_error("unable to read block %d (block is reserved)\n", block);
+	for (shift = AFFS_BLOCKSHIFT_MIN; shift <= AFFS_BLOCKSHIFT_MAX; ++shift) {
+		if (size == 1 << shift) {
+			info.blocksize = size;
+			info.blockshift = shift;
+			info.hashsize = size / 4 - 56;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * block cache
+ *
+ * The cache holds info.cachesize KB worth of blocks, which are replaced
+ * using the clock algorithm. Writes go straight through to the device,
+ * so the cache never contains dirty data. The slots are (re)allocated
+ * whenever the blocksize changes (e.g. while the root block is searched).
+ * The directory walk may read blocks from several threads, so the cache
+ * is protected by a lock (which is never held during I/O).
+ */
+
+#define AFFS_CACHE_FREE		((u32)-1)
+
+struct affs_cache_slot {
+	u32 block;
+	s32 next;
+	int ref;
+};
+
+static struct affs_cache_slot *cache_slot;
+static s32 *cache_hash;
+static u8 *cache_data;
+static u32 cache_size, cache_hashmask, cache_hand, cache_shift;
+
+#if HAVE_LIBPTHREAD
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#define affs_cache_lock()	pthread_mutex_lock(&cache_lock)
+#define affs_cache_unlock()	pthread_mutex_unlock(&cache_lock)
+#else
+#define affs_cache_lock()	do { } while (0)
+#define affs_cache_unlock()	do { } while (0)
+#endif
+
+static void affs_cache_setup(void)
+{
+	u32 i;
+
+	free(cache_slot);
+	free(cache_hash);
+	free(cache_data);
+	cache_slot = NULL;
+	cache_hash = NULL;
+	cache_data = NULL;
+	cache_hand = 0;
+	cache_shift = info.blockshift;
+
+	cache_size = (info.cachesize << 1) >> (info.blockshift - AFFS_BLOCKSHIFT_MIN);
+	if (affs_map)
+		cache_size = 0;
+	if (!cache_size)
+		return;
+	for (i = 1; i < cache_size; i <<= 1)
+		;
+	cache_hashmask = i - 1;
+
+	cache_slot = malloc(cache_size * sizeof(*cache_slot));
+	cache_hash = malloc(i * sizeof(*cache_hash));
+	cache_data = malloc(cache_size << info.blockshift);
+	if (!cache_slot || !cache_hash || !cache_data) {
+		affs_error("unable to allocate block cache\n");
+		free(cache_slot);
+		free(cache_hash);
+		free(cache_data);
+		cache_slot = NULL;
+		cache_hash = NULL;
+		cache_data = NULL;
+		cache_size = 0;
+		return;
+	}
+	for (i = 0; i <= cache_hashmask; ++i)
+		cache_hash[i] = -1;
+	for (i = 0; i < cache_size; ++i) {
+		cache_slot[i].block = AFFS_CACHE_FREE;
+		cache_slot[i].next = -1;
+		cache_slot[i].ref = 0;
+	}
+}
+
+static u8 *affs_cache_lookup(u32 block)
+{
+	s32 i;
+
+	if (cache_shift != info.blockshift)
+		affs_cache_setup();
+	if (!cache_size)
+		return NULL;
+
+	for (i = cache_hash[block & cache_hashmask]; i >= 0; i = cache_slot[i].next) {
+		if (cache_slot[i].block == block) {
+			cache_slot[i].ref = 1;
+			return cache_data + ((u32)i << cache_shift);
+		}
+	}
+	return NULL;
+}
+
+/* like affs_cache_lookup, but doesn't count as a reference */
+static int affs_cache_peek(u32 block)
+{
+	s32 i;
+
+	if (cache_shift != info.blockshift || !cache_size)
+		return 0;
+
+	for (i = cache_hash[block & cache_hashmask]; i >= 0; i = cache_slot[i].next)
+		if (cache_slot[i].block == block)
+			return 1;
+	return 0;
+}
+
+static u8 *affs_cache_insert(u32 block)
+{
+	struct affs_cache_slot *slot;
+	s32 *pp;
+	u32 i;
+
+	if (!cache_size)
+		return NULL;
+
+	/* find a victim, giving referenced blocks a second chance */
+	for (;;) {
+		slot = &cache_slot[cache_hand];
+		if (!slot->ref)
+			break;
+		slot->ref = 0;
+		if (++cache_hand == cache_size)
+			cache_hand = 0;
+	}
+	i = cache_hand;
+	if (++cache_hand == cache_size)
+		cache_hand = 0;
+
+	if (slot->block != AFFS_CACHE_FREE) {
+		for (pp = &cache_hash[slot->block & cache_hashmask]; (u32)*pp != i; pp = &cache_slot[*pp].next)
+			;
+		*pp = slot->next;
+	}
+	slot->block = block;
+	slot->ref = 1;
+	slot->next = cache_hash[block & cache_hashmask];
+	cache_hash[block & cache_hashmask] = i;
+
+	return cache_data + (i << cache_shift);
+}
+
+static void affs_cache_forget(u32 block)
+{
+	s32 *pp, i;
+
+	for (pp = &cache_hash[block & cache_hashmask]; (i = *pp) >= 0; pp = &cache_slot[i].next) {
+		if (cache_slot[i].block == block) {
+			*pp = cache_slot[i].next;
+			cache_slot[i].block = AFFS_CACHE_FREE;
+			cache_slot[i].ref = 0;
+			return;
+		}
+	}
+}
+
+/*
+ * memory mapped device
+ *
+ * Regular image files are mapped into memory, so reads are simple
+ * copies (or no copy at all with affs_bget) and writes modify the
+ * mapping, which is written back by affs_bsync.
+ */
+
+int affs_map_device(off_t size)
+{
+#if HAVE_MMAP
+	void *map;
+
+	if (size <= 0 || size != (size_t)size)
 		return 1;
-	} else if (block >= info.blocks) {
-		affs_error("unable to read block %d (block is out of range)\n", block);
+	map = mmap(NULL, size, info.read ? PROT_READ : PROT_READ | PROT_WRITE,
+		   MAP_SHARED, info.devfd, 0);
+	if (map == MAP_FAILED) {
+		affs_print(1, "unable to map '%s' (%s)\n", info.device, strerror(errno));
 		return 1;
 	}
+	affs_map = map;
+	affs_mapsize = size;
+	affs_mapwrite = !info.read;
+	/* the mapping replaces the block cache */
+	cache_shift = 0;
+	return 0;
+#else
+	return 1;
+#endif
+}
+
+static u8 *affs_map_block(u32 block, u32 cnt)
+{
+	off_t pos = (off_t)block << info.blockshift;
+
+	if (pos + ((off_t)cnt << info.blockshift) > affs_mapsize)
+		return NULL;
+	return affs_map + pos;
+}
+
+int affs_bsync(void)
+{
+	int res = 0;
+
+#if HAVE_MMAP
+	if (affs_map && affs_mapwrite)
+		res = msync(affs_map, affs_mapsize, MS_SYNC);
+	else
+#endif
+	if (!info.read)
+		res = fsync(info.devfd);
+	if (res) {
+		affs_error("unable to sync '%s' (%s)\n", info.device, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+void affs_cache_stat(void)
+{
+	affs_print(1, "block cache: %u hits, %u misses, %u prefetched\n",
+		   info.cachestat.hit, info.cachestat.miss, info.cachestat.prefetch);
+	if (info.cachestat.guess)
+		affs_print(1, "extension readahead: %u of %u guesses hit\n",
+			   info.cachestat.guess_hit, info.cachestat.guess);
+}
+
+static ssize_t affs_pread(void *data, size_t size, off_t pos)
+{
+	if (affs_map) {
+		if (pos >= affs_mapsize)
+			return 0;
+		if (size > affs_mapsize - pos)
+			size = affs_mapsize - pos;
+		memcpy(data, affs_map + pos, size);
+		return size;
+	}
+#if HAVE_PREAD
+	return pread(info.devfd, data, size, pos);
+#else
+	if (lseek(info.devfd, pos, SEEK_SET) < 0)
+		return -1;
+	return read(info.devfd, data, size);
+#endif
+}
+
+static ssize_t affs_pwrite(void *data, size_t size, off_t pos)
+{
+	if (affs_map && affs_mapwrite) {
+		if (pos >= affs_mapsize)
+			return 0;
+		if (size > affs_mapsize - pos)
+			size = affs_mapsize - pos;
+		memcpy(affs_map + pos, data, size);
+		return size;
+	}
+#if HAVE_PWRITE
+	return pwrite(info.devfd, data, size, pos);
+#else
+	if (lseek(info.devfd, pos, SEEK_SET) < 0)
+		return -1;
+	return write(info.devfd, data, size);
+#endif
+}
+
+static ssize_t affs_pwritev(struct iovec *iov, int iovcnt, off_t pos)
+{
+	ssize_t res, size = 0;
+	int i;
+
+#if HAVE_PWRITEV
+	if (!affs_map || !affs_mapwrite)
+		return pwritev(info.devfd, iov, iovcnt, pos);
+#endif
+	for (i = 0; i < iovcnt; ++i) {
+		res = affs_pwrite(iov[i].iov_base, iov[i].iov_len, pos + size);
+		if (res < 0)
+			return res;
+		size += res;
+		if (res != iov[i].iov_len)
+			break;
+	}
+	return size;
+}
 
-	if (lseek(info.devfd, (off_t)block << info.blockshift, SEEK_SET) < 0) {
-		affs_error("unable to seek to block %d (%s)\n", block, strerror(errno));
+static int affs_check_range(char *op, u32 block, u32 cnt)
+{
+	if (block < info.reserved) {
+		affs_error("unable to %s block %d (block is reserved)\n", op, block);
+		return 1;
+	} else if (block >= info.blocks || cnt > info.blocks - block) {
+		affs_error("unable to %s block %d (block is out of range)\n", op,
+			   block >= info.blocks ? block : info.blocks);
 		return 1;
 	}
+	return 0;
+}
 
-	res = read(info.devfd, data, info.blocksize);
-	if (res == info.blocksize)
+static int affs_check_io(char *op, ssize_t res, u32 block, u32 cnt)
+{
+	ssize_t size = (ssize_t)cnt << info.blockshift;
+
+	if (res == size)
 		return 0;
 	if (res < 0) {
-		affs_error("unable to read block %d (%s)\n", block, strerror(errno));
+		affs_error("unable to %s block %d (%s)\n", op, block, strerror(errno));
 		return 1;
 	}
-	affs_error("short read of block %d (%d of %d)\n", block, res, info.blocksize);
+	affs_error("short %s of block %d (%d of %d)\n", op, block, (int)res, (int)size);
 	return 1;
 }
 
+int affs_bread(void *data, u32 block)
+{
+	u8 *cache;
+
+	if (affs_check_range("read", block, 1))
+		return 1;
+
+	affs_cache_lock();
+	cache = affs_cache_lookup(block);
+	if (cache) {
+		memcpy(data, cache, info.blocksize);
+		affs_cache_unlock();
+		affs_atomic_add(&info.cachestat.hit, 1);
+		return 0;
+	}
+	affs_cache_unlock();
+	affs_atomic_add(&info.cachestat.miss, 1);
+
+	if (affs_check_io("read", affs_pread(data, info.blocksize, (off_t)block << info.blockshift), block, 1))
+		return 1;
+
+	affs_cache_lock();
+	/* another thread may have read it meanwhile */
+	cache = affs_cache_lookup(block);
+	if (!cache)
+		cache = affs_cache_insert(block);
+	if (cache)
+		memcpy(cache, data, info.blocksize);
+	affs_cache_unlock();
+	return 0;
+}
+
 int affs_bwrite(void *data, u32 block)
 {
-	int res;
+	u8 *cache;
 
-	if (block < info.reserved) {
-		affs_error("unable to write block %d (block is reserved)\n", block);
+	if (affs_check_range("write", block, 1))
 		return 1;
-	} else if (block >= info.blocks) {
-		affs_error("unable to write block %d (block is out of range)\n", block);
+
+	if (affs_check_io("write", affs_pwrite(data, info.blocksize, (off_t)block << info.blockshift), block, 1)) {
+		/* don't keep a copy, that doesn't match the device anymore */
+		affs_cache_lock();
+		if (cache_size)
+			affs_cache_forget(block);
+		affs_cache_unlock();
 		return 1;
 	}
 
-	if (lseek(info.devfd, (off_t)block << info.blockshift, SEEK_SET) < 0) {
-		affs_error("unable to seek to block %d (%s)\n", block, strerror(errno));
+	affs_cache_lock();
+	cache = affs_cache_lookup(block);
+	if (!cache)
+		cache = affs_cache_insert(block);
+	if (cache)
+		memcpy(cache, data, info.blocksize);
+	affs_cache_unlock();
+	return 0;
+}
+
+/*
+ * Like affs_bread, but if the device is mapped into memory, a pointer
+ * into the mapping is returned instead of copying the block to data.
+ * The result must not be modified. Returns NULL on error.
+ */
+void *affs_bget(void *data, u32 block)
+{
+	u8 *ptr;
+
+	if (affs_map) {
+		if (affs_check_range("read", block, 1))
+			return NULL;
+		ptr = affs_map_block(block, 1);
+		if (ptr)
+			return ptr;
+	}
+	return affs_bread(data, block) ? NULL : data;
+}
+
+/*
+ * Read/write cnt consecutive blocks with a single request. The data is
+ * expected to be mostly used once (like the bitmap), so it's not
+ * entered into the block cache, but cached copies are kept up to date.
+ */
+int affs_bread_run(void *data, u32 block, u32 cnt)
+{
+	if (affs_check_range("read", block, cnt))
 		return 1;
+
+	/* may be called by several threads (see affs_read_bitmap) */
+	affs_atomic_add(&info.cachestat.miss, cnt);
+	return affs_check_io("read", affs_pread(data, (size_t)cnt << info.blockshift,
+						(off_t)block << info.blockshift), block, cnt);
+}
+
+void *affs_bget_run(void *data, u32 block, u32 cnt)
+{
+	u8 *ptr;
+
+	if (affs_map) {
+		if (affs_check_range("read", block, cnt))
+			return NULL;
+		ptr = affs_map_block(block, cnt);
+		if (ptr)
+			return ptr;
 	}
+	return affs_bread_run(data, block, cnt) ? NULL : data;
+}
 
-	res = write(info.devfd, data, info.blocksize);
-	if (res == info.blocksize)
-		return 0;
-	if (res < 0) {
-		affs_error("unable to write block %d (%s)\n", block, strerror(errno));
+int affs_bwrite_run(void *data, u32 block, u32 cnt)
+{
+	u8 *cache;
+	u32 i;
+
+	if (affs_check_range("write", block, cnt))
+		return 1;
+
+	if (affs_check_io("write", affs_pwrite(data, (size_t)cnt << info.blockshift,
+					       (off_t)block << info.blockshift), block, cnt)) {
+		affs_cache_lock();
+		for (i = 0; cache_size && i < cnt; ++i)
+			affs_cache_forget(block + i);
+		affs_cache_unlock();
 		return 1;
 	}
-	affs_error("short write of block %d (%d of %d)\n", block, res, info.blocksize);
-	return 1;
+
+	affs_cache_lock();
+	for (i = 0; i < cnt; ++i) {
+		cache = affs_cache_lookup(block + i);
+		if (cache)
+			memcpy(cache, (u8 *)data + (i << info.blockshift), info.blocksize);
+	}
+	affs_cache_unlock();
+	return 0;
 }
 
-u32 affs_checksum(void *data)
+/*
+ * Write cnt consecutive blocks gathered from iovcnt buffers with a
+ * single request, cached copies of the blocks are dropped.
+ */
+int affs_bwritev(struct iovec *iov, int iovcnt, u32 block, u32 cnt)
+{
+	u32 i;
+	int res;
+
+	if (affs_check_range("write", block, cnt))
+		return 1;
+
+	res = affs_check_io("write", affs_pwritev(iov, iovcnt, (off_t)block << info.blockshift),
+			    block, cnt);
+	affs_cache_lock();
+	for (i = 0; cache_size && i < cnt; ++i)
+		affs_cache_forget(block + i);
+	affs_cache_unlock();
+	return res;
+}
+
+static int affs_cmp_block(const void *a, const void *b)
 {
-	u32 *ptr = (u32 *)data;
-	u32 chksum = 0;
-	int cnt;
+	u32 x = *(const u32 *)a, y = *(const u32 *)b;
 
-	for (cnt = info.blocksize / 4; cnt > 0; ++ptr, --cnt)
-		chksum += be32_to_cpu(*ptr);
-	return chksum;
+	return x < y ? -1 : x > y;
 }
 
+/*
+ * Announce that the blocks in table (in disk byte order, zero entries
+ * are ignored) will be read soon. The blocks are sorted and merged into
+ * ranges, which are handed to the kernel, so it can start reading all of
+ * them at once, while we still process the previous block.
+ */
+void affs_bprefetch(u32 *table, u32 cnt)
+{
+#if HAVE_POSIX_FADVISE
+	u32 blocks[AFFS_BLOCKSIZE_MAX/4];
+	u32 i, n, block;
+
+	if (cnt > AFFS_BLOCKSIZE_MAX/4)
+		cnt = AFFS_BLOCKSIZE_MAX/4;
+	affs_cache_lock();
+	for (i = n = 0; i < cnt; ++i) {
+		block = be32_to_cpu(table[i]);
+		if (block < info.reserved || block >= info.blocks)
+			continue;
+		if (affs_cache_peek(block))
+			continue;
+		blocks[n++] = block;
+	}
+	affs_cache_unlock();
+	if (!n)
+		return;
+	qsort(blocks, n, sizeof(u32), affs_cmp_block);
+
+	for (i = 0; i < n; i = cnt) {
+		for (cnt = i + 1; cnt < n && blocks[cnt] <= blocks[cnt - 1] + 1; ++cnt)
+			;
+		block = blocks[cnt - 1] - blocks[i] + 1;
+		posix_fadvise(info.devfd, (off_t)blocks[i] << info.blockshift,
+			      (off_t)block << info.blockshift, POSIX_FADV_WILLNEED);
+		affs_atomic_add(&info.cachestat.prefetch, block);
+	}
+#endif
+}
+
+/*
+ * Speculative readahead of extension chains
+ *
+ * The next extension block of a file is only known after the current
+ * one was read, so a big file costs a round-trip per extension block.
+ * FFS usually puts an extension block right behind the data blocks of
+ * the previous table, so as long as that is true for the chain, the
+ * distance between the last two blocks is likely to repeat. The block
+ * at that distance is announced to the kernel, before the current one
+ * is even read. Hits are counted, so the guess can be judged (affsck -v).
+ */
+void affs_breadahead_init(struct affs_readahead *ra, u32 block)
+{
+	ra->last = block;
+	ra->guess = 0;
+}
+
+/*
+ * next is the extension block the block table of ra->last points to (in
+ * disk byte order, AFFS_BLOCKTABLESIZE entries) and left is the # of
+ * data blocks that are still expected after that table.
+ */
+void affs_breadahead(struct affs_readahead *ra, u32 next, u32 left, u32 *table)
+{
+	u32 i, block, high = 0;
+
+	if (ra->guess) {
+		if (ra->guess == next)
+			affs_atomic_add(&info.cachestat.guess_hit, 1);
+		ra->guess = 0;
+	}
+
+	/* no extension block will follow next or the chain isn't regular */
+	if (left <= AFFS_BLOCKTABLESIZE || next <= ra->last)
+		goto out;
+	for (i = 0; i < AFFS_BLOCKTABLESIZE; ++i) {
+		block = be32_to_cpu(table[i]);
+		if (block > high)
+			high = block;
+	}
+	if (high + 1 != next)
+		goto out;
+
+	block = next + (next - ra->last);
+	if (block < next || block >= info.blocks)
+		goto out;
+	ra->guess = block;
+	affs_atomic_add(&info.cachestat.guess, 1);
+#if HAVE_POSIX_FADVISE
+	affs_cache_lock();
+	i = affs_cache_peek(block);
+	affs_cache_unlock();
+	if (!i) {
+		posix_fadvise(info.devfd, (off_t)block << info.blockshift,
+			      info.blocksize, POSIX_FADV_WILLNEED);
+		affs_atomic_add(&info.cachestat.prefetch, 1);
+	}
+#endif
+out:
+	ra->last = next;
+}
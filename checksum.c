@@ -0,0 +1,254 @@
+/*
+ *  Copyright (C) 2000  Roman Zippel
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "affs_config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "amigaffs.h"
+
+/*
+ * The checksum of a block is the sum of all its (big endian) longwords.
+ * Besides the plain C version there are vectorized versions, one of
+ * them is selected at the first call depending on the cpu features.
+ * The C version is the reference, a vectorized version is only used if
+ * it agrees with it.
+ * Every version is compiled once for every blocksize, so the loops have
+ * a constant trip count, the right one is selected whenever the
+ * blocksize changes. The last entry of every table is the generic
+ * version for any number of longwords. All versions, which can be used
+ * on this cpu, are compared with the C version by checksum_test.
+ */
+
+#ifdef __GNUC__
+#define affs_inline	inline __attribute__ ((always_inline))
+#else
+#define affs_inline	inline
+#endif
+
+#define AFFS_CHECKSUM_SIZED(name, attr)					\
+attr static u32 name##_512(u32 *ptr, u32 cnt) { return name(ptr, 512 / 4); }	\
+attr static u32 name##_1024(u32 *ptr, u32 cnt) { return name(ptr, 1024 / 4); }	\
+attr static u32 name##_2048(u32 *ptr, u32 cnt) { return name(ptr, 2048 / 4); }	\
+attr static u32 name##_4096(u32 *ptr, u32 cnt) { return name(ptr, 4096 / 4); }	\
+attr static u32 name##_any(u32 *ptr, u32 cnt) { return name(ptr, cnt); }	\
+static u32 (* const name##_sized[])(u32 *ptr, u32 cnt) = {		\
+	name##_512, name##_1024, name##_2048, name##_4096, name##_any	\
+}
+
+static affs_inline u32 affs_checksum_c(u32 *ptr, u32 cnt)
+{
+	u32 chksum = 0;
+
+	for (; cnt > 0; ++ptr, --cnt)
+		chksum += be32_to_cpu(*ptr);
+	return chksum;
+}
+AFFS_CHECKSUM_SIZED(affs_checksum_c, );
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(WORDS_BIGENDIAN)
+#define AFFS_CHECKSUM_X86
+#include <immintrin.h>
+
+__attribute__ ((target ("sse2")))
+static affs_inline u32 affs_checksum_sse2(u32 *ptr, u32 cnt)
+{
+	__m128i sum = _mm_setzero_si128();
+	__m128i x;
+
+	for (; cnt >= 4; ptr += 4, cnt -= 4) {
+		x = _mm_loadu_si128((__m128i *)ptr);
+		/* swap the bytes of each word, then the words of each long */
+		x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+		x = _mm_shufflelo_epi16(x, 0xb1);
+		x = _mm_shufflehi_epi16(x, 0xb1);
+		sum = _mm_add_epi32(sum, x);
+	}
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+	return _mm_cvtsi128_si32(sum) + affs_checksum_c(ptr, cnt);
+}
+AFFS_CHECKSUM_SIZED(affs_checksum_sse2, __attribute__ ((target ("sse2"))));
+
+__attribute__ ((target ("avx2")))
+static affs_inline u32 affs_checksum_avx2(u32 *ptr, u32 cnt)
+{
+	const __m256i swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+					      3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	__m256i sum0 = _mm256_setzero_si256(), sum1 = _mm256_setzero_si256();
+	__m128i sum;
+
+	for (; cnt >= 16; ptr += 16, cnt -= 16) {
+		sum0 = _mm256_add_epi32(sum0, _mm256_shuffle_epi8(_mm256_loadu_si256((__m256i *)ptr), swap));
+		sum1 = _mm256_add_epi32(sum1, _mm256_shuffle_epi8(_mm256_loadu_si256((__m256i *)(ptr + 8)), swap));
+	}
+	sum0 = _mm256_add_epi32(sum0, sum1);
+	sum = _mm_add_epi32(_mm256_castsi256_si128(sum0), _mm256_extracti128_si256(sum0, 1));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+	return _mm_cvtsi128_si32(sum) + affs_checksum_c(ptr, cnt);
+}
+AFFS_CHECKSUM_SIZED(affs_checksum_avx2, __attribute__ ((target ("avx2"))));
+#endif
+
+#if defined(__ARM_NEON) && !defined(WORDS_BIGENDIAN)
+#define AFFS_CHECKSUM_NEON
+#include <arm_neon.h>
+
+static affs_inline u32 affs_checksum_neon(u32 *ptr, u32 cnt)
+{
+	uint32x4_t sum0 = vdupq_n_u32(0), sum1 = vdupq_n_u32(0);
+	uint32x2_t sum;
+
+	for (; cnt >= 8; ptr += 8, cnt -= 8) {
+		sum0 = vaddq_u32(sum0, vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8((u8 *)ptr))));
+		sum1 = vaddq_u32(sum1, vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8((u8 *)(ptr + 4)))));
+	}
+	sum0 = vaddq_u32(sum0, sum1);
+	sum = vadd_u32(vget_low_u32(sum0), vget_high_u32(sum0));
+	sum = vpadd_u32(sum, sum);
+	return vget_lane_u32(sum, 0) + affs_checksum_c(ptr, cnt);
+}
+AFFS_CHECKSUM_SIZED(affs_checksum_neon, );
+#endif
+
+/* the selected version for every blocksize */
+static u32 (* const *affs_checksum_impl)(u32 *ptr, u32 cnt);
+/* the selected version for the current blocksize */
+static u32 (*affs_checksum_fn)(u32 *ptr, u32 cnt);
+static u32 affs_checksum_size;
+
+/* compare a vectorized version with the C version on some random data */
+static int affs_checksum_verify(u32 (* const *impl)(u32 *ptr, u32 cnt))
+{
+	u32 data[AFFS_BLOCKSIZE_MAX/4 + 1];
+	u32 i, seed = 0x12345678;
+
+	for (i = 0; i <= AFFS_BLOCKSIZE_MAX/4; ++i) {
+		seed = seed * 1103515245 + 12345;
+		data[i] = seed ^ (seed >> 16);
+	}
+	for (i = 0; i <= AFFS_BLOCKSHIFT_MAX - AFFS_BLOCKSHIFT_MIN; ++i) {
+		/* also check an unaligned block */
+		if (impl[i](data, 0) != affs_checksum_c_sized[i](data, 0) ||
+		    impl[i](data + 1, 0) != affs_checksum_c_sized[i](data + 1, 0))
+			return 1;
+	}
+	/* an odd number of longwords exercises the tail loops */
+	i = AFFS_BLOCKSIZE_MAX/4 - 1;
+	if (impl[AFFS_CHECKSUM_ANY](data + 1, i) != affs_checksum_c_sized[AFFS_CHECKSUM_ANY](data + 1, i))
+		return 1;
+	return 0;
+}
+
+/* all versions, which are built and supported by the cpu, the best one is last */
+const struct affs_checksum_impl *affs_checksum_impls(u32 *cnt)
+{
+	static struct affs_checksum_impl impls[4];
+	u32 n = 0;
+
+	impls[n].name = "c";
+	impls[n++].sized = affs_checksum_c_sized;
+#ifdef AFFS_CHECKSUM_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		impls[n].name = "sse2";
+		impls[n++].sized = affs_checksum_sse2_sized;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		impls[n].name = "avx2";
+		impls[n++].sized = affs_checksum_avx2_sized;
+	}
+#endif
+#ifdef AFFS_CHECKSUM_NEON
+	impls[n].name = "neon";
+	impls[n++].sized = affs_checksum_neon_sized;
+#endif
+	*cnt = n;
+	return impls;
+}
+
+static void affs_checksum_select(void)
+{
+	u32 (* const *impl)(u32 *ptr, u32 cnt) = affs_checksum_impl;
+	const struct affs_checksum_impl *impls;
+	u32 n;
+
+	if (!impl) {
+		impls = affs_checksum_impls(&n);
+		impl = impls[n - 1].sized;
+		if (impl != affs_checksum_c_sized && affs_checksum_verify(impl)) {
+			affs_error("vectorized checksum is broken, using C version\n");
+			impl = affs_checksum_c_sized;
+		}
+		affs_checksum_impl = impl;
+	}
+
+	affs_checksum_size = info.blocksize;
+	affs_checksum_fn = impl[info.blockshift - AFFS_BLOCKSHIFT_MIN];
+}
+
+u32 affs_checksum(void *data)
+{
+	if (affs_checksum_size != info.blocksize)
+		affs_checksum_select();
+	return affs_checksum_fn(data, info.blocksize / 4);
+}
+
+/* sum of cnt (big endian) longwords, e.g. a bitmap block without its checksum */
+u32 affs_checksum_words(void *data, u32 cnt)
+{
+	if (affs_checksum_size != info.blocksize)
+		affs_checksum_select();
+	return affs_checksum_impl[AFFS_CHECKSUM_ANY](data, cnt);
+}
+
+/*
+ * The hash of a name selects the hash chain of a directory entry. The
+ * name is converted to upper case first, the international variant
+ * (also used by the dircache filesystems) converts the latin-1 letters
+ * too. Both conversion tables are built by the compiler.
+ */
+#define AFFS_UPPER(c, intl)	((c) >= 'a' && (c) <= 'z' ? (c) - 32 :		\
+				 (intl) && (c) >= 0xe0 && (c) <= 0xfe && (c) != 0xf7 ? (c) - 32 : (c))
+#define AFFS_UPPER4(c, intl)	AFFS_UPPER(c, intl), AFFS_UPPER(c + 1, intl),	\
+				AFFS_UPPER(c + 2, intl), AFFS_UPPER(c + 3, intl)
+#define AFFS_UPPER16(c, intl)	AFFS_UPPER4(c, intl), AFFS_UPPER4(c + 4, intl),	\
+				AFFS_UPPER4(c + 8, intl), AFFS_UPPER4(c + 12, intl)
+#define AFFS_UPPER64(c, intl)	AFFS_UPPER16(c, intl), AFFS_UPPER16(c + 16, intl),	\
+				AFFS_UPPER16(c + 32, intl), AFFS_UPPER16(c + 48, intl)
+#define AFFS_UPPER256(intl)	AFFS_UPPER64(0, intl), AFFS_UPPER64(64, intl),	\
+				AFFS_UPPER64(128, intl), AFFS_UPPER64(192, intl)
+
+static const u8 affs_upper[2][256] = {
+	{ AFFS_UPPER256(0) },
+	{ AFFS_UPPER256(1) },
+};
+
+/* hash chain of the name (a BCPL string as in the header blocks) */
+u32 affs_name_hash(u8 *name)
+{
+	const u8 *upper = affs_upper[info.intl || info.dcache];
+	u32 len, hash;
+
+	len = name[0] > AFFS_NAME_MAX ? AFFS_NAME_MAX : name[0];
+	for (hash = len; len > 0; --len)
+		hash = (hash * 13 + upper[*++name]) & 0x7ff;
+	return hash % AFFS_HASHTABLESIZE;
+}
@@ -0,0 +1,100 @@
+/*
+ *  Copyright (C) 2000  Roman Zippel
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Compare every version of the checksum, which can be used on this cpu,
+ * with the C version: random blocks of every blocksize are checksummed
+ * at every longword offset within the widest vector, the generic
+ * version also with any number of longwords up to the longest tail.
+ */
+
+#include "affs_config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "amigaffs.h"
+
+struct affs_info info;
+char affs_prog[] = "checksum_test";
+
+#define AFFS_TEST_ROUNDS	64
+/* # of longwords in the widest vector (avx2) */
+#define AFFS_TEST_ALIGN		8
+/* longer than the tail of any vectorized loop */
+#define AFFS_TEST_TAIL		(4 * AFFS_TEST_ALIGN)
+
+static u32 affs_test_seed = 0x12345678;
+
+static u32 affs_test_random(void)
+{
+	affs_test_seed ^= affs_test_seed << 13;
+	affs_test_seed ^= affs_test_seed >> 17;
+	affs_test_seed ^= affs_test_seed << 5;
+	return affs_test_seed;
+}
+
+static int affs_test_impl(const struct affs_checksum_impl *ref,
+			  const struct affs_checksum_impl *impl,
+			  u32 *data, u32 size, u32 round)
+{
+	u32 (*fn)(u32 *ptr, u32 cnt);
+	u32 i, off, cnt;
+
+	for (i = 0; i <= AFFS_CHECKSUM_ANY; ++i) {
+		fn = impl->sized[i];
+		if (i < AFFS_CHECKSUM_ANY)
+			cnt = 1 << (i + AFFS_BLOCKSHIFT_MIN - 2);
+		else if (round < AFFS_TEST_TAIL)
+			cnt = round;
+		else
+			cnt = affs_test_random() % (size + 1);
+		for (off = 0; off < AFFS_TEST_ALIGN; ++off) {
+			if (fn(data + off, cnt) == ref->sized[AFFS_CHECKSUM_ANY](data + off, cnt))
+				continue;
+			fprintf(stderr, "checksum_test: %s version fails for %u longwords at offset %u\n",
+				impl->name, cnt, off);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	static u32 data[AFFS_BLOCKSIZE_MAX/4 + AFFS_TEST_ALIGN];
+	const struct affs_checksum_impl *impls;
+	u32 cnt, i, round, size;
+
+	size = AFFS_BLOCKSIZE_MAX/4;
+	impls = affs_checksum_impls(&cnt);
+	for (round = 0; round < AFFS_TEST_ROUNDS; ++round) {
+		/* the first round checks the carries of all ones */
+		for (i = 0; i < size + AFFS_TEST_ALIGN; ++i)
+			data[i] = round ? affs_test_random() : ~0U;
+		for (i = 0; i < cnt; ++i)
+			if (affs_test_impl(&impls[0], &impls[i], data, size, round))
+				return 1;
+	}
+
+	printf("checksum versions tested:");
+	for (i = 0; i < cnt; ++i)
+		printf(" %s", impls[i].name);
+	printf("\n");
+	return 0;
+}
@@ -0,0 +1,480 @@
+/* 
+ *  Copyright (C) 2000  Roman Zippel
+ *  
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *  
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "affs_config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#if HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#include "amigaffs.h"
+
+/*
+ * directory cache
+ *
+ * On a dircache filesystem every directory has a chain of dcache blocks
+ * with a record for each entry, so a directory can be listed without
+ * reading every header. While the tree is walked, the dcache blocks of
+ * every directory are collected, the entries themselves are found in
+ * the inode table. After the walk the records of each chain are compared
+ * with the entries of the directory, which are found by key in the
+ * inode table. With -w a chain that is out of date is rebuilt from the
+ * inode table, the records are packed into as few blocks as possible and
+ * every run of consecutive blocks is written with a single request.
+ */
+
+struct affs_dcache_blk {
+	u32 dir;
+	u32 block;
+	/* order in which the blocks of a chain were found */
+	u32 seq;
+};
+
+/* size of the fixed part of a record (up to the name length) */
+#define AFFS_DCACHE_REC		24
+
+/* flag of the inode table records (see link.c): the record was found in the chain */
+#define AFFS_DCACHE_SEEN	4
+
+static struct affs_dcache_blk *affs_dc_blk;
+static u32 affs_dc_blk_cnt, affs_dc_blk_size;
+#if HAVE_LIBPTHREAD
+static pthread_mutex_t affs_dc_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* the inode table records sorted by directory */
+static struct affs_inode **affs_dc_ent;
+static u32 affs_dc_ent_size;
+/* the new records of a rebuilt chain and its blocks */
+static u8 *affs_dc_buf;
+static u32 *affs_dc_keys;
+static u32 affs_dc_buf_size;
+/* set if the walk couldn't remember everything, the chains aren't checked then */
+static int affs_dc_nomem;
+
+/*
+ * make room for need elements at ptr, returns NULL (ptr is kept) if
+ * that fails, the failure is reported once
+ */
+static void *affs_dcache_grow(void *ptr, u32 *size, u32 need, size_t elem)
+{
+	static int nomem;
+	u32 new;
+
+	if (need <= *size)
+		return ptr;
+	for (new = *size ? *size : 256; new < need; new *= 2)
+		;
+	ptr = realloc(ptr, new * elem);
+	if (!ptr) {
+		if (!nomem++)
+			affs_error("unable to allocate dcache index\n");
+		return NULL;
+	}
+	*size = new;
+	return ptr;
+}
+
+static u32 affs_get_be(u8 *p, int n)
+{
+	u32 val = 0;
+
+	while (n--)
+		val = (val << 8) | *p++;
+	return val;
+}
+
+static void affs_put_be(u8 *p, int n, u32 val)
+{
+	while (n--) {
+		p[n] = val;
+		val >>= 8;
+	}
+}
+
+/* remember that block is part of the dcache chain of directory dir */
+void affs_dcache_block(u32 dir, u32 block)
+{
+	struct affs_dcache_blk *blk;
+
+#if HAVE_LIBPTHREAD
+	pthread_mutex_lock(&affs_dc_lock);
+#endif
+	blk = affs_dcache_grow(affs_dc_blk, &affs_dc_blk_size, affs_dc_blk_cnt + 1,
+			       sizeof(*affs_dc_blk));
+	if (!blk) {
+		affs_dc_nomem = 1;
+		goto out;
+	}
+	affs_dc_blk = blk;
+	blk = &affs_dc_blk[affs_dc_blk_cnt];
+	blk->dir = dir;
+	blk->block = block;
+	blk->seq = affs_dc_blk_cnt++;
+out:
+#if HAVE_LIBPTHREAD
+	pthread_mutex_unlock(&affs_dc_lock);
+#endif
+}
+
+static int affs_cmp_ent(const void *a, const void *b)
+{
+	const struct affs_inode *x = *(struct affs_inode **)a, *y = *(struct affs_inode **)b;
+
+	if (x->dir != y->dir)
+		return x->dir < y->dir ? -1 : 1;
+	return x->key < y->key ? -1 : x->key > y->key;
+}
+
+static int affs_cmp_blk(const void *a, const void *b)
+{
+	const struct affs_dcache_blk *x = a, *y = b;
+
+	if (x->dir != y->dir)
+		return x->dir < y->dir ? -1 : 1;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* first entry of directory dir (affs_dc_ent is sorted) */
+static u32 affs_dcache_find_ent(u32 dir, u32 cnt)
+{
+	u32 lo = 0, hi = cnt, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (affs_dc_ent[mid]->dir < dir)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* first dcache block of directory dir (affs_dc_blk is sorted) */
+static u32 affs_dcache_find_blk(u32 dir)
+{
+	u32 lo = 0, hi = affs_dc_blk_cnt, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (affs_dc_blk[mid].dir < dir)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* does the record rec describe the entry inode? */
+static int affs_dcache_match(struct affs_inode *inode, u8 *rec)
+{
+	u8 *name = affs_inode_name(inode), *comment = affs_inode_comment(inode);
+	u8 *rname = rec + AFFS_DCACHE_REC - 1, *rcomment = rname + 1 + rname[0];
+
+	return affs_get_be(rec + 4, 4) == inode->size &&
+	       affs_get_be(rec + 8, 4) == inode->protect &&
+	       affs_get_be(rec + 16, 2) == (u16)inode->days &&
+	       affs_get_be(rec + 18, 2) == inode->mins &&
+	       affs_get_be(rec + 20, 2) == inode->ticks &&
+	       (s8)rec[22] == inode->type &&
+	       !memcmp(rname, name, name[0] + 1) &&
+	       !memcmp(rcomment, comment, comment[0] + 1);
+}
+
+/*
+ * Compare the dcache chain (first is its first block, blk the blocks
+ * found by the walk) of directory dir with its cnt entries (ent).
+ * Returns 1 if the chain doesn't match.
+ */
+static int affs_dcache_cmp(u32 dir, u32 first, struct affs_inode **ent, u32 cnt,
+			   struct affs_dcache_blk *blk, u32 blk_cnt)
+{
+	struct affs_dcache_head *head;
+	struct affs_inode *inode;
+	u8 data[AFFS_BLOCKSIZE_MAX], *buf, *rec, *end;
+	u32 i, j, n, len, bad = 0, missing = 0;
+
+	if (!first) {
+		affs_error("directory %u has no dcache\n", dir);
+		return 1;
+	}
+	/* the walk stops at a broken block, so the chain must be complete */
+	if (!blk_cnt || blk[0].block != first)
+		bad++;
+	for (i = 0; i < blk_cnt; ++i) {
+		buf = affs_bget(data, blk[i].block);
+		if (!buf) {
+			bad++;
+			continue;
+		}
+		head = AFFS_DCACHE_HEAD(buf);
+		if (be32_to_cpu(head->primary_type) != T_DIRC ||
+		    be32_to_cpu(head->parent) != dir)
+			bad++;
+		if (i == blk_cnt - 1 && head->next)
+			bad++;
+		end = buf + info.blocksize;
+		rec = (u8 *)head->entry;
+		n = be32_to_cpu(head->dcache_count);
+		for (j = 0; j < n; ++j, rec += len) {
+			if (rec + AFFS_DCACHE_REC + 1 > end ||
+			    rec + AFFS_DCACHE_REC + rec[23] + 1 > end) {
+				bad++;
+				break;
+			}
+			len = AFFS_DCACHE_REC + rec[23] + 1 + rec[AFFS_DCACHE_REC + rec[23]];
+			if (rec + len > end) {
+				bad++;
+				break;
+			}
+			len = (len + 1) & ~1;
+			inode = affs_inode_find(affs_get_be(rec, 4));
+			if (!inode || inode->dir != dir || (inode->flags & AFFS_DCACHE_SEEN) ||
+			    !affs_dcache_match(inode, rec)) {
+				bad++;
+				continue;
+			}
+			inode->flags |= AFFS_DCACHE_SEEN;
+		}
+	}
+	for (i = 0; i < cnt; ++i)
+		if (!(ent[i]->flags & AFFS_DCACHE_SEEN))
+			missing++;
+	if (!bad && !missing)
+		return 0;
+	affs_error("dcache of directory %u is out of date (%u bad records, %u missing)\n",
+		   dir, bad, missing);
+	return 1;
+}
+
+/* put the record of the entry inode at rec, returns its size */
+static u32 affs_dcache_record(u8 *rec, struct affs_inode *inode)
+{
+	u8 *name = affs_inode_name(inode), *comment = affs_inode_comment(inode);
+	u32 len;
+
+	len = AFFS_DCACHE_REC + name[0] + 1 + comment[0];
+	if (!rec)
+		return (len + 1) & ~1;
+
+	memset(rec, 0, (len + 1) & ~1);
+	affs_put_be(rec, 4, inode->key);
+	affs_put_be(rec + 4, 4, inode->size);
+	affs_put_be(rec + 8, 4, inode->protect);
+	affs_put_be(rec + 16, 2, inode->days);
+	affs_put_be(rec + 18, 2, inode->mins);
+	affs_put_be(rec + 20, 2, inode->ticks);
+	rec[22] = inode->type;
+	memcpy(rec + AFFS_DCACHE_REC - 1, name, name[0] + 1);
+	memcpy(rec + AFFS_DCACHE_REC + name[0], comment, comment[0] + 1);
+	return (len + 1) & ~1;
+}
+
+/* set the first dcache block of directory dir */
+static int affs_dcache_link(u32 dir, u32 first)
+{
+	u8 data[AFFS_BLOCKSIZE_MAX];
+
+	if (dir == info.root) {
+		/* written with the root block */
+		AFFS_ROOT_TAIL(affs_rootbuf)->dcache = cpu_to_be32(first);
+		return 0;
+	}
+	if (affs_bread(data, dir))
+		return 1;
+	AFFS_DIR_TAIL(data)->dcache = cpu_to_be32(first);
+	AFFS_DIR_HEAD(data)->checksum = 0;
+	AFFS_DIR_HEAD(data)->checksum = cpu_to_be32(-affs_checksum(data));
+	return affs_bwrite(data, dir);
+}
+
+/*
+ * Build a new dcache chain for directory dir from its cnt entries. The
+ * blocks of the old chain (blk) are used again, more blocks are taken
+ * near them and the ones not needed anymore are freed.
+ */
+static int affs_dcache_rebuild(u32 dir, u32 first, struct affs_inode **ent, u32 cnt,
+			       struct affs_dcache_blk *blk, u32 blk_cnt)
+{
+	struct affs_dcache_head *head = NULL;
+	u8 *rec = NULL, *dc_buf;
+	u32 i, n, len, block, got, goal, *keys;
+
+	/* pack the records, the entries are sorted by block */
+	n = 0;
+	for (i = 0; i <= cnt; ++i) {
+		len = i < cnt ? affs_dcache_record(NULL, ent[i]) : 0;
+		if (!head || (i < cnt && rec + len > (u8 *)head + info.blocksize)) {
+			n++;
+			dc_buf = affs_dcache_grow(affs_dc_buf, &affs_dc_buf_size,
+						  n * info.blocksize, 1);
+			if (!dc_buf)
+				return 1;
+			affs_dc_buf = dc_buf;
+			head = AFFS_DCACHE_HEAD(&affs_dc_buf[(n - 1) * info.blocksize]);
+			memset(head, 0, info.blocksize);
+			head->primary_type = cpu_to_be32(T_DIRC);
+			head->parent = cpu_to_be32(dir);
+			rec = (u8 *)head->entry;
+		}
+		if (i < cnt) {
+			rec += affs_dcache_record(rec, ent[i]);
+			head->dcache_count = cpu_to_be32(be32_to_cpu(head->dcache_count) + 1);
+		}
+	}
+
+	/* the old blocks first, then as few runs of new blocks as possible */
+	keys = realloc(affs_dc_keys, n * sizeof(*affs_dc_keys));
+	if (!keys) {
+		affs_error("unable to allocate dcache of directory %u\n", dir);
+		return 1;
+	}
+	affs_dc_keys = keys;
+	for (got = 0; got < n && got < blk_cnt; ++got)
+		affs_dc_keys[got] = blk[got].block;
+	goal = got ? affs_dc_keys[got - 1] : dir;
+	while (got < n) {
+		block = affs_alloc_extent(goal, n - got, &len);
+		if (!block) {
+			affs_error("no space for the dcache of directory %u\n", dir);
+			while (got > blk_cnt)
+				affs_release_block(affs_dc_keys[--got]);
+			return 1;
+		}
+		for (i = 0; i < len; ++i)
+			affs_dc_keys[got++] = block + i;
+		goal = block + len;
+	}
+
+	for (i = 0; i < n; ++i) {
+		head = AFFS_DCACHE_HEAD(&affs_dc_buf[i * info.blocksize]);
+		head->own_key = cpu_to_be32(affs_dc_keys[i]);
+		head->next = cpu_to_be32(i + 1 < n ? affs_dc_keys[i + 1] : 0);
+		head->checksum = cpu_to_be32(-affs_checksum(head));
+	}
+	for (i = 0; i < n; i += len) {
+		for (len = 1; i + len < n && len < AFFS_RUN_MAX &&
+			      affs_dc_keys[i + len] == affs_dc_keys[i] + len; ++len)
+			;
+		affs_print(2, "write dcache of %u: %u (%u blocks)\n", dir, affs_dc_keys[i], len);
+		if (affs_bwrite_run(affs_dc_buf + i * info.blocksize, affs_dc_keys[i], len))
+			return 1;
+	}
+	for (i = n; i < blk_cnt; ++i)
+		affs_release_block(blk[i].block);
+	if (affs_dc_keys[0] != first)
+		return affs_dcache_link(dir, affs_dc_keys[0]);
+	return 0;
+}
+
+/*
+ * Check the dcache chains of all directories found by the walk and
+ * rebuild the ones that are out of date. The new blocks must be free in
+ * the old bitmap too (see affs_alloc_extent), so that's needed and the
+ * walk must have been complete and without errors (broken dcache chains
+ * don't count, they are rebuilt).
+ */
+int affs_verify_dcache(void)
+{
+	struct affs_inode *inode, **ent;
+	u32 i, cnt, dir, first, e, b, en, bn, dirs = 0, bad = 0;
+	int fix;
+
+	if (!info.dcache)
+		return 0;
+	cnt = affs_inode_count();
+	ent = affs_dcache_grow(affs_dc_ent, &affs_dc_ent_size, cnt, sizeof(*affs_dc_ent));
+	if (affs_dc_nomem || (!ent && cnt)) {
+		affs_print(1, "dcache chains not checked (not enough memory)\n");
+		goto out;
+	}
+	affs_dc_ent = ent;
+
+	fix = info.write && !info.read && !info.errstat.bitmap_block &&
+	      !info.errstat.bitmap_missing && !info.errstat.tree && affs_old_bitmap;
+	for (i = 0; i < cnt; ++i)
+		ent[i] = affs_inode_nth(i);
+	if (cnt)
+		qsort(ent, cnt, sizeof(*ent), affs_cmp_ent);
+	if (affs_dc_blk_cnt)
+		qsort(affs_dc_blk, affs_dc_blk_cnt, sizeof(*affs_dc_blk), affs_cmp_blk);
+
+	/* the root directory and then every directory entry */
+	for (i = 0; i <= cnt; ++i) {
+		if (!i) {
+			dir = info.root;
+			first = be32_to_cpu(AFFS_ROOT_TAIL(affs_rootbuf)->dcache);
+		} else {
+			inode = ent[i - 1];
+			if (inode->type != ST_USERDIR)
+				continue;
+			dir = inode->key;
+			/* the first dcache block is kept as extension */
+			first = inode->extension;
+		}
+		dirs++;
+		for (en = e = affs_dcache_find_ent(dir, cnt); en < cnt && ent[en]->dir == dir; ++en)
+			;
+		for (bn = b = affs_dcache_find_blk(dir); bn < affs_dc_blk_cnt &&
+							affs_dc_blk[bn].dir == dir; ++bn)
+			;
+		if (!affs_dcache_cmp(dir, first, ent + e, en - e, affs_dc_blk + b, bn - b))
+			continue;
+		bad++;
+		if (fix && !affs_dcache_rebuild(dir, first, ent + e, en - e,
+						affs_dc_blk + b, bn - b))
+			affs_print(1, "rebuilt dcache of directory %u\n", dir);
+	}
+	if (bad)
+		affs_print(1, "%u of %u dcache chains out of date\n", bad, dirs);
+	if (bad && info.write && !info.read && !fix)
+		affs_print(1, "dcache chains not rebuilt (%s)\n",
+			   !affs_old_bitmap ? "low memory mode" :
+			   info.errstat.tree ? "errors in the directory tree" : "bitmap not intact");
+
+out:
+	free(affs_dc_blk);
+	free(affs_dc_ent);
+	free(affs_dc_buf);
+	free(affs_dc_keys);
+	affs_dc_blk = NULL;
+	affs_dc_ent = NULL;
+	affs_dc_buf = NULL;
+	affs_dc_keys = NULL;
+	affs_dc_blk_cnt = affs_dc_blk_size = 0;
+	affs_dc_ent_size = affs_dc_buf_size = 0;
+	affs_dc_nomem = 0;
+	return 0;
+}
+
+/* create an empty dcache for the new directory dir (see mkaffs) */
+int affs_create_dcache(u32 dir)
+{
+	int res;
+
+	res = affs_dcache_rebuild(dir, 0, NULL, 0, NULL, 0);
+	free(affs_dc_buf);
+	free(affs_dc_keys);
+	affs_dc_buf = NULL;
+	affs_dc_keys = NULL;
+	affs_dc_buf_size = 0;
+	return res;
+}
@@ -22,6 +22,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#if HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
 
 #include "amigaffs.h"   
 
@@ -104,35 +107,36 @@ int affs_write_type(void)
 		return 1;
 	}
 
+	/* the dircache types use the international names as well, so they win */
 	if (info.mufs) {
 		if (info.ofs) {
-			if (info.intl)
-				type = MUFS_INTLOFS;
-			else if (info.dcache)
+			if (info.dcache)
 				type = MUFS_DCOFS;
+			else if (info.intl)
+				type = MUFS_INTLOFS;
 			else
 				type = MUFS_OFS;
 		} else {
-			if (info.intl)
-				type = MUFS_INTLFFS;
-			else if (info.dcache)
+			if (info.dcache)
 				type = MUFS_DCFFS;
+			else if (info.intl)
+				type = MUFS_INTLFFS;
 			else
 				type = MUFS_FFS;
 		}
 	} else {
 		if (info.ofs) {
-			if (info.intl)
-				type = FS_INTLOFS;
-			else if (info.dcache)
+			if (info.dcache)
 				type = FS_DCOFS;
+			else if (info.intl)
+				type = FS_INTLOFS;
 			else
 				type = FS_OFS;
 		} else {
-			if (info.intl)
-				type = FS_INTLFFS;
-			else if (info.dcache)
+			if (info.dcache)
 				type = FS_DCFFS;
+			else if (info.intl)
+				type = FS_INTLFFS;
 			else
 				type = FS_FFS;
 		}
@@ -148,7 +152,7 @@ int affs_write_type(void)
 
 int affs_find_root(void)
 {
-	u32 orig_size;
+	u32 orig_size, size;
 	u32 root = info.blocks / 2;
 	int i = 8;
 	struct affs_root_head *head = AFFS_ROOT_HEAD(affs_rootbuf);
@@ -167,8 +171,7 @@ int affs_find_root(void)
 
 	for (; i > 0; ++root, --i) {
 		/* initialize values needed for affs_bread */
-		info.blocksize = AFFS_BLOCKSIZE_MIN;
-		info.blockshift = AFFS_BLOCKSHIFT_MIN;
+		affs_set_blocksize(AFFS_BLOCKSIZE_MIN);
 		if (affs_bread(affs_rootbuf, root))
 			break;
 
@@ -177,37 +180,24 @@ int affs_find_root(void)
 		    be32_to_cpu(head->spare1) == 0 &&
 		    be32_to_cpu(head->spare2) == 0 &&
 		    be32_to_cpu(head->spare3) == 0) {
-			info.blocksize = (be32_to_cpu(head->hash_size) + 56) * 4;
+			size = (be32_to_cpu(head->hash_size) + 56) * 4;
 			/* accept only if calculated and specified blocksize agree */
-			if (orig_size && info.blocksize != orig_size)
-				continue;
-			switch (info.blocksize) {
-			case 512:
-				info.blockshift = 9;
-				break;
-			case 1024:
-				info.blockshift = 10;
-				break;
-			case 2048:
-				info.blockshift = 11;
-				break;
-			case 4096:
-				info.blockshift = 12;
-				break;
-			default:
+			if (orig_size && size != orig_size)
 				continue;
-			}
-			info.root = root >> (info.blockshift - AFFS_BLOCKSHIFT_MIN);
-			if (info.blocksize > AFFS_BLOCKSIZE_MIN) {
+			if (size != info.blocksize) {
+				if (affs_set_blocksize(size))
+					continue;
 				/* reread root block and check again
 				 * (this detects a misaligned block)
 				 */
-				affs_bread(affs_rootbuf, root);
+				if (affs_bread(affs_rootbuf, root >> (info.blockshift - AFFS_BLOCKSHIFT_MIN)))
+					continue;
 				goto recheck;
 			}
 			tail = AFFS_ROOT_TAIL(affs_rootbuf);
 			if (be32_to_cpu(tail->secondary_type) == ST_ROOT &&
 			    affs_checksum(affs_rootbuf) == 0) {
+				info.root = root >> (info.blockshift - AFFS_BLOCKSHIFT_MIN);
 				affs_print(1, "root block found at %d\n", info.root);
 				info.blocks = info.blocks >> (info.blockshift - AFFS_BLOCKSHIFT_MIN);
 				return 0;
@@ -229,7 +219,7 @@ void affs_init_root(void)
 
 	memset(affs_rootbuf, 0, info.blocksize);
 	head->primary_type = cpu_to_be32(T_SHORT);
-	head->hash_size = cpu_to_be32((info.blocksize / 4) - 56);
+	head->hash_size = cpu_to_be32(AFFS_HASHTABLESIZE);
 
 	memset(&date, 0, sizeof(date));
 	curtime = time(NULL);
@@ -264,218 +254,1583 @@ int affs_write_root(void)
 	return affs_bwrite(affs_rootbuf, info.root);
 }
 
+/*
+ * Print the listing of the header entry in buf, the fields used are at
+ * the same place in all tails. Nothing is decoded, if the listing isn't
+ * printed at all.
+ */
+static void affs_print_header(u8 *buf)
+{
+	struct affs_file_tail *tail = AFFS_FILE_TAIL(buf);
+	struct affs_listing entry;
+
+	if (info.verbose < 1)
+		return;
+	entry.key = be32_to_cpu(AFFS_FILE_HEAD(buf)->own_key);
+	entry.type = be32_to_cpu(tail->secondary_type);
+	entry.size = be32_to_cpu(tail->byte_size);
+	entry.protect = be32_to_cpu(tail->protect);
+	entry.original = be32_to_cpu(tail->original);
+	entry.date = &tail->file_change;
+	entry.name = tail->file_name;
+	entry.comment = tail->comment;
+	affs_print_entry(1, &entry);
+}
+
 void affs_print_link(u_char *buf)
 {
-	struct affs_dir_head *head = AFFS_DIR_HEAD(buf);
-	struct affs_dir_tail *tail = AFFS_DIR_TAIL(buf);
-	time_t time;
-	u8 date[] = "                         ";
+	affs_print_header(buf);
+}
 
-	affs_print(1, "%10u ", be32_to_cpu(head->own_key));
-	affs_print(1, "%-30.*s ", tail->dir_name[0], tail->dir_name + 1);
-	switch (be32_to_cpu(tail->secondary_type)) {
-	case ST_LINKFILE:
-		affs_print(1, "<FILELINK> ");
-		break;
-	case ST_LINKDIR:
-		affs_print(1, " <LINKDIR> ");
-		break;
-	case ST_SOFTLINK:
-		affs_print(1, "<SOFTLINK> ");
-		break;
-	default:
-		affs_print(1, "     <?\?\?> ");
-		break;
+void affs_print_file(u_char *buf)
+{
+	affs_print_header(buf);
+}
+
+/*
+ * OFS data block check
+ *
+ * With info.datacheck every data block of an OFS file is remembered
+ * during the walk, together with its file and the # of data blocks left
+ * from it to the end of the file. Afterwards (affs_check_data) the
+ * expected header of each data block is computed, the blocks are sorted
+ * and read in large runs by several workers, which compare the headers.
+ */
+
+struct affs_data_ref {
+	u32 block;
+	u32 file;
+	/*
+	 * # of blocks left (including this one), later the expected sequence
+	 * number, data size and next data block (AFFS_DATA_UNKNOWN if not known)
+	 */
+	u32 seq;
+	u32 size;
+	u32 next;
+};
+
+#define AFFS_DATA_UNKNOWN	((u32)-1)
+/* max. # of unused blocks read between two data blocks */
+#define AFFS_DATA_GAP		16
+
+struct affs_data_file {
+	u32 file;
+	u32 size;
+};
+
+static struct affs_data_ref *affs_data;
+static u32 affs_data_cnt, affs_data_size;
+static struct affs_data_file *affs_data_files;
+static u32 affs_data_file_cnt, affs_data_file_size;
+/* set if the list couldn't grow, the data blocks aren't checked then */
+static int affs_data_nomem;
+#if HAVE_LIBPTHREAD
+static pthread_mutex_t affs_data_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* make room for need elements at ptr, returns NULL (ptr is kept) if that fails */
+static void *affs_data_alloc(void *ptr, u32 *size, u32 need, size_t elem)
+{
+	u32 new;
+
+	if (need <= *size)
+		return ptr;
+	for (new = *size ? *size : 1024; new < need; new *= 2)
+		;
+	ptr = realloc(ptr, new * elem);
+	if (!ptr) {
+		if (!affs_data_nomem++)
+			affs_error("unable to allocate data block list\n");
+		return NULL;
 	}
-	time = (be32_to_cpu(tail->dir_change.days) * (24 * 60 * 60)) +
-	       (be32_to_cpu(tail->dir_change.mins) * 60) +
-	       (be32_to_cpu(tail->dir_change.ticks) / 50) +
-	       ((8 * 365 + 2) * 24 * 60 * 60);
-	strftime(date, sizeof(date) - 1, "%a %b %e %T %Y ", localtime(&time));
-	affs_print(1, date);
-	// protection bits
-	affs_print(1, " %*s\n", tail->comment[0], tail->comment + 1);
+	*size = new;
+	return ptr;
 }
 
-void affs_print_file(u_char *buf)
+/* remember the data blocks in ref[0..cnt) and the size of file (if it's not 0) */
+static void affs_data_add(u32 file, u32 size, struct affs_data_ref *ref, u32 cnt)
 {
-	struct affs_file_head *head = AFFS_FILE_HEAD(buf);
-	struct affs_file_tail *tail = AFFS_FILE_TAIL(buf);
-	time_t time;
-	u8 date[] = "                         ";
+	void *ptr;
 
-	affs_print(1, "%10u ", be32_to_cpu(head->own_key));
-	affs_print(1, "%-30.*s ", tail->file_name[0], tail->file_name + 1);
-	affs_print(1, "%10u ", be32_to_cpu(tail->byte_size));
-	time = (be32_to_cpu(tail->file_change.days) * (24 * 60 * 60)) +
-	       (be32_to_cpu(tail->file_change.mins) * 60) +
-	       (be32_to_cpu(tail->file_change.ticks) / 50) +
-	       ((8 * 365 + 2) * 24 * 60 * 60);
-	strftime(date, sizeof(date) - 1, "%a %b %e %T %Y ", localtime(&time));
-	affs_print(1, date);
-	// protection bits
-	affs_print(1, "%*s\n", tail->comment[0], tail->comment + 1);
+#if HAVE_LIBPTHREAD
+	pthread_mutex_lock(&affs_data_lock);
+#endif
+	if (affs_data_nomem)
+		goto out;
+	if (size) {
+		ptr = affs_data_alloc(affs_data_files, &affs_data_file_size,
+				      affs_data_file_cnt + 1, sizeof(*affs_data_files));
+		if (!ptr)
+			goto out;
+		affs_data_files = ptr;
+		affs_data_files[affs_data_file_cnt].file = file;
+		affs_data_files[affs_data_file_cnt].size = size;
+		affs_data_file_cnt++;
+	}
+	if (cnt) {
+		ptr = affs_data_alloc(affs_data, &affs_data_size, affs_data_cnt + cnt,
+				      sizeof(*affs_data));
+		if (!ptr)
+			goto out;
+		affs_data = ptr;
+		memcpy(affs_data + affs_data_cnt, ref, cnt * sizeof(*ref));
+		affs_data_cnt += cnt;
+	}
+out:
+#if HAVE_LIBPTHREAD
+	pthread_mutex_unlock(&affs_data_lock);
+#endif
 }
 
-int affs_read_file(u_char *buf)
+/*
+ * Check the block table of the header or an extension block entry (read
+ * into buf) of file and mark the data blocks allocated. *block_cnt is the
+ * # of data blocks that are still expected, *block is set to the last
+ * data block. Returns the next extension block.
+ */
+static u32 affs_read_blocks(u32 file, u32 entry, u8 *buf, u32 *block_cnt, u32 *block)
 {
 	struct affs_file_head *head = AFFS_FILE_HEAD(buf);
 	struct affs_file_tail *tail = AFFS_FILE_TAIL(buf);
+	struct affs_data_ref ref[AFFS_BLOCKSIZE_MAX/4];
+	u32 cnt = *block_cnt, n = 0;
 	int i;
-	u32 entry, block, block_cnt;
 
-	entry = be32_to_cpu(head->own_key);
+	*block = be32_to_cpu(head->block_count);
+	if ((cnt > AFFS_BLOCKTABLESIZE && *block != AFFS_BLOCKTABLESIZE) ||
+	    (cnt <= AFFS_BLOCKTABLESIZE && *block != cnt)) {
+		affs_error("wrong blockcount %d in %d\n", *block, entry);
+	}
+	for (i = AFFS_BLOCKTABLESIZE - 1; i >= 0; --i) {
+		*block = be32_to_cpu(head->blocktable[i]);
+		if (!*block && !cnt)
+			continue;
+		if (!cnt) {
+			affs_error("block %d exceeds file size\n", *block);
+			continue;
+		}
+		affs_print(2, " [%u]", *block);
+		if (affs_claim_block(*block, file) != 1 && info.datacheck) {
+			ref[n].block = *block;
+			ref[n].file = file;
+			ref[n].seq = cnt;
+			n++;
+		}
+		cnt--;
+	}
+	if (info.datacheck && (n || entry == file))
+		affs_data_add(file, entry == file ? be32_to_cpu(tail->byte_size) : 0, ref, n);
+	*block_cnt = cnt;
+	return be32_to_cpu(tail->extension);
+}
+
+/*
+ * Check the extension block entry of file, block is the last data block
+ * before it. Returns 1 if the chain mustn't be followed after this block
+ * and 2 if this block mustn't be used at all (it's invalid or was seen
+ * before by this file). A block of another file is still followed (the
+ * chain ends with the file size anyway), so it doesn't matter which of
+ * the files is checked first.
+ */
+static int affs_check_ext(u32 file, u32 entry, u32 block_cnt, u32 block)
+{
+	int res;
+
+	if (!block_cnt) {
+		affs_error("extended block %d exceeds file size\n", block);
+		/* it isn't claimed, so a loop wouldn't be noticed */
+		return 1;
+	}
+	res = affs_claim_block(entry, file);
+	if (res == 1 || res == 3)
+		return 2;
+	affs_print(2, "\n [ext:%u]", entry);
+	return 0;
+}
+
+int affs_read_file(u32 file, u_char *buf)
+{
+	struct affs_file_tail *tail = AFFS_FILE_TAIL(buf);
+	struct affs_readahead ra;
+	u8 data[AFFS_BLOCKSIZE_MAX];
+	u32 entry, next, block, block_cnt;
+	int res = 0;
+
 	block_cnt = (be32_to_cpu(tail->byte_size) + info.datablocksize - 1) / info.datablocksize;
-	do {
-		block = be32_to_cpu(head->block_count);
-		if ((block_cnt > AFFS_BLOCKTABLESIZE && block != AFFS_BLOCKTABLESIZE) ||
-		    (block_cnt <= AFFS_BLOCKTABLESIZE && block != block_cnt)) {
-			affs_error("wrong blockcount %d in %d\n", block, entry);
+	affs_breadahead_init(&ra, file);
+	for (entry = file; ; entry = next) {
+		next = affs_read_blocks(file, entry, buf, &block_cnt, &block);
+		if (!next || res)
+			break;
+		affs_breadahead(&ra, next, block_cnt, AFFS_FILE_HEAD(buf)->blocktable);
+		buf = affs_bget(data, next);
+		if (!buf)
+			break;
+		res = affs_check_ext(file, next, block_cnt, block);
+		if (res == 2)
+			break;
+	}
+	affs_print(2, "\n");
+	return 0;
+}
+
+static int affs_cmp_data_file(const void *a, const void *b)
+{
+	const struct affs_data_ref *x = a, *y = b;
+
+	if (x->file != y->file)
+		return x->file < y->file ? -1 : 1;
+	/* the first block of a file has the most blocks left */
+	return x->seq > y->seq ? -1 : x->seq < y->seq;
+}
+
+static int affs_cmp_data_block(const void *a, const void *b)
+{
+	const struct affs_data_ref *x = a, *y = b;
+
+	return x->block < y->block ? -1 : x->block > y->block;
+}
+
+static int affs_cmp_file(const void *a, const void *b)
+{
+	const struct affs_data_file *x = a, *y = b;
+
+	return x->file < y->file ? -1 : x->file > y->file;
+}
+
+/* compute the expected header of every data block */
+static void affs_data_expect(void)
+{
+	struct affs_data_ref *ref;
+	struct affs_data_file key, *f = NULL;
+	u32 i, total = 0;
+
+	qsort(affs_data, affs_data_cnt, sizeof(*affs_data), affs_cmp_data_file);
+	qsort(affs_data_files, affs_data_file_cnt, sizeof(*affs_data_files), affs_cmp_file);
+	for (i = 0; i < affs_data_cnt; ++i) {
+		ref = &affs_data[i];
+		if (!f || f->file != ref->file) {
+			key.file = ref->file;
+			f = bsearch(&key, affs_data_files, affs_data_file_cnt,
+				    sizeof(*affs_data_files), affs_cmp_file);
+			if (f)
+				total = (f->size + info.datablocksize - 1) / info.datablocksize;
 		}
-		for (i = AFFS_BLOCKTABLESIZE - 1; i >= 0; --i) {
-			block = be32_to_cpu(head->blocktable[i]);
-			if (!block && !block_cnt)
-				continue;
-			if (!block_cnt) {
-				affs_error("block %d exceeds file size\n", block);
-				continue;
-			}
-			affs_print(2, " [%u]", block);
-			affs_alloc_block(block);
-			block_cnt--;
+		if (!f) {
+			/* the file header had no valid data block, only the type can be checked */
+			ref->seq = ref->size = ref->next = AFFS_DATA_UNKNOWN;
+			continue;
 		}
-		entry = be32_to_cpu(tail->extension);
-		if (entry) {
-			affs_bread(buf, entry);
-			if (!block_cnt)
-				affs_error("extended block %d exceeds file size\n", block);
-			else {
-				affs_alloc_block(entry);
-				affs_print(2, "\n [ext:%u]", entry);
-			}
+		if (ref->seq == 1)
+			ref->next = 0;
+		else if (i + 1 < affs_data_cnt && affs_data[i + 1].file == ref->file &&
+			 affs_data[i + 1].seq == ref->seq - 1)
+			ref->next = affs_data[i + 1].block;
+		else
+			ref->next = AFFS_DATA_UNKNOWN;
+		ref->size = ref->seq == 1 ? f->size - (total - 1) * info.datablocksize :
+			    info.datablocksize;
+		ref->seq = total - ref->seq + 1;
+	}
+	qsort(affs_data, affs_data_cnt, sizeof(*affs_data), affs_cmp_data_block);
+}
+
+static void affs_data_check_block(struct affs_data_ref *ref, u8 *buf)
+{
+	struct affs_data_head *head = AFFS_DATA_HEAD(buf);
+
+	if (affs_checksum(buf)) {
+		affs_error("data block %d has invalid checksum\n", ref->block);
+		return;
+	}
+	if (be32_to_cpu(head->primary_type) != T_DATA)
+		affs_error("data block %d has invalid primary type %d\n", ref->block,
+			be32_to_cpu(head->primary_type));
+	if (be32_to_cpu(head->header_key) != ref->file)
+		affs_error("data block %d has header key %u (expected %u)\n", ref->block,
+			be32_to_cpu(head->header_key), ref->file);
+	if (ref->seq != AFFS_DATA_UNKNOWN && be32_to_cpu(head->sequence_number) != ref->seq)
+		affs_error("data block %d has sequence number %u (expected %u)\n", ref->block,
+			be32_to_cpu(head->sequence_number), ref->seq);
+	if (ref->size != AFFS_DATA_UNKNOWN && be32_to_cpu(head->data_size) != ref->size)
+		affs_error("data block %d has data size %u (expected %u)\n", ref->block,
+			be32_to_cpu(head->data_size), ref->size);
+	if (ref->next != AFFS_DATA_UNKNOWN && be32_to_cpu(head->next_data) != ref->next)
+		affs_error("data block %d has next block %u (expected %u)\n", ref->block,
+			be32_to_cpu(head->next_data), ref->next);
+}
+
+/*
+ * Like affs_load_bitmap, the sorted list is split between the workers.
+ * Close blocks are read with a single request (including the blocks in
+ * between), so the device is read mostly sequentially.
+ */
+struct affs_data_load {
+	/* part of the data block list [first, first + cnt) */
+	u32 first, cnt;
+	/* buffer for AFFS_DATA_RUN blocks */
+	u8 *buf;
+	struct affs_output out;
+#if HAVE_LIBPTHREAD
+	pthread_t thread;
+	int started;
+#endif
+};
+
+static void *affs_load_data_blocks(void *arg)
+{
+	struct affs_data_load *load = arg;
+	u32 i, j, n, block, end, single;
+	u8 *buf;
+
+	affs_set_output(&load->out);
+	end = load->first + load->cnt;
+	single = 0;
+	for (i = load->first; i < end; i = j) {
+		block = affs_data[i].block;
+		/* the same block may be listed twice (a cross link) */
+		for (j = i + 1; i >= single && j < end; ++j)
+			if (affs_data[j].block - block >= AFFS_DATA_RUN ||
+			    affs_data[j].block - affs_data[j - 1].block > AFFS_DATA_GAP)
+				break;
+		n = affs_data[j - 1].block - block + 1;
+		buf = affs_bget_run(load->buf, block, n);
+		if (!buf) {
+			if (j > i + 1) {
+				/* retry block by block to find the bad one */
+				single = j;
+				j = i;
+			} else
+				j = i + 1;
+			continue;
 		}
-	} while (entry);
-	affs_print(2, "\n");
+		for (; i < j; ++i)
+			affs_data_check_block(&affs_data[i],
+					      buf + ((affs_data[i].block - block) << info.blockshift));
+	}
+	affs_set_output(NULL);
+	return NULL;
+}
+
+/*
+ * Check the headers of all data blocks found by the directory walk
+ * (OFS only), the errors are printed in block order.
+ */
+int affs_check_data(void)
+{
+	struct affs_data_load load[AFFS_THREADS_MAX];
+	u32 i, n, chunk;
+
+	if (affs_data_nomem) {
+		affs_print(1, "data blocks not checked (not enough memory)\n");
+		goto out;
+	}
+	if (!info.datacheck || !affs_data_cnt)
+		goto out;
+
+	affs_data_expect();
+
+	n = 1;
+#if HAVE_LIBPTHREAD
+	n = (affs_data_cnt + AFFS_DATA_RUN - 1) / AFFS_DATA_RUN;
+	if (n > info.threads)
+		n = info.threads;
+	if (n > AFFS_THREADS_MAX)
+		n = AFFS_THREADS_MAX;
+	if (n < 1)
+		n = 1;
+#endif
+	for (i = 0; i < n; ++i) {
+		load[i].buf = malloc(AFFS_DATA_RUN * info.blocksize);
+		if (!load[i].buf)
+			break;
+		memset(&load[i].out, 0, sizeof(load[i].out));
+	}
+	if (!i) {
+		affs_error("unable to allocate data block buffer\n");
+		goto out;
+	}
+	/* fewer workers, if we're short of memory */
+	n = i;
+	chunk = (affs_data_cnt + n - 1) / n;
+	for (i = 0; i < n; ++i) {
+		load[i].first = i * chunk;
+		load[i].cnt = 0;
+		if (load[i].first < affs_data_cnt)
+			load[i].cnt = affs_data_cnt - load[i].first;
+		if (load[i].cnt > chunk)
+			load[i].cnt = chunk;
+	}
+	affs_print(1, "checking %u data blocks\n", affs_data_cnt);
+
+#if HAVE_LIBPTHREAD
+	for (i = 1; i < n; ++i)
+		load[i].started = !pthread_create(&load[i].thread, NULL,
+						  affs_load_data_blocks, &load[i]);
+#endif
+	affs_load_data_blocks(&load[0]);
+	for (i = 1; i < n; ++i) {
+#if HAVE_LIBPTHREAD
+		if (load[i].started)
+			pthread_join(load[i].thread, NULL);
+		else
+#endif
+			affs_load_data_blocks(&load[i]);
+	}
+	for (i = 0; i < n; ++i) {
+		if (load[i].out.len)
+			affs_write(load[i].out.buf, load[i].out.len);
+		free(load[i].out.buf);
+		free(load[i].buf);
+	}
+
+out:
+	free(affs_data);
+	free(affs_data_files);
+	affs_data = NULL;
+	affs_data_files = NULL;
+	affs_data_cnt = affs_data_size = 0;
+	affs_data_file_cnt = affs_data_file_size = 0;
+	affs_data_nomem = 0;
 	return 0;
 }
 
 void affs_print_dir(u_char *buf)
 {
-	struct affs_dir_head *head = AFFS_DIR_HEAD(buf);
-	struct affs_dir_tail *tail = AFFS_DIR_TAIL(buf);
-	time_t time;
-	char date[] = "                         ";
+	affs_print_header(buf);
+}
 
-	affs_print(1, "%10u ", be32_to_cpu(head->own_key));
-	affs_print(1, "%-30.*s ", tail->dir_name[0], tail->dir_name + 1);
-	affs_print(1, "     <DIR> ");
-	time = (be32_to_cpu(tail->dir_change.days) * (24 * 60 * 60)) +
-	       (be32_to_cpu(tail->dir_change.mins) * 60) +
-	       (be32_to_cpu(tail->dir_change.ticks) / 50) +
-	       ((8 * 365 + 2) * 24 * 60 * 60);
-	strftime(date, sizeof(date) - 1, "%a %b %e %T %Y ", localtime(&time));
-	affs_print(1, date);
-	// protection bits
-	affs_print(1, " %*s\n", tail->comment[0], tail->comment + 1);
+/*
+ * Check the dcache block (read into buf) of directory dir and mark it
+ * allocated, *next is set to the next block of the chain. Returns 1 if
+ * the chain can't be followed. Errors of the chain itself are counted
+ * in errstat.dcache, they don't keep it from being rebuilt. Like an
+ * extension block, a block that is used elsewhere as well is still
+ * followed, but only the blocks of dir itself, which ends a loop.
+ */
+static int affs_check_dcache(u32 dir, u32 block, u8 *buf, u32 *next)
+{
+	struct affs_dcache_head *head = AFFS_DCACHE_HEAD(buf);
+	int res;
+
+	if (affs_checksum(buf)) {
+		affs_error("dcache entry %u has invalid checksum\n", block);
+		affs_atomic_add(&info.errstat.dcache, 1);
+		return 1;
+	}
+	if (be32_to_cpu(head->primary_type) != T_DIRC) {
+		affs_error("dcache entry %u has invalid primary type %u\n", block,
+			be32_to_cpu(head->primary_type));
+		affs_atomic_add(&info.errstat.dcache, 1);
+		return 1;
+	}
+	if (be32_to_cpu(head->own_key) != block) {
+		affs_error("dcache entry %u has wrong key %u\n", block,
+			be32_to_cpu(head->own_key));
+		affs_atomic_add(&info.errstat.dcache, 1);
+	}
+	if (be32_to_cpu(head->parent) != dir) {
+		affs_error("dcache entry %u belongs to directory %u\n", block,
+			be32_to_cpu(head->parent));
+		affs_atomic_add(&info.errstat.dcache, 1);
+		return 1;
+	}
+	res = affs_claim_block(block, dir);
+	if (res == 1 || res == 3)
+		return 1;
+	affs_dcache_block(dir, block);
+	affs_print(2, " [%u]", block);
+	*next = be32_to_cpu(head->next);
+	return 0;
 }
 
-int affs_read_dcache(u32 block)
+int affs_read_dcache(u32 dir, u32 block)
 {
-	struct affs_dcache_head *head;
-	u8 buf[AFFS_BLOCKSIZE_MAX];
+	u8 data[AFFS_BLOCKSIZE_MAX], *buf;
+	int res = 0, printed = 0;
 
-	head = AFFS_DCACHE_HEAD(buf);
 	while (block) {
-		if (affs_bread(buf, block))
-			return 1;
-		if (affs_checksum(buf)) {
-			affs_error("dcache entry %d has invalid checksum\n", block);
-			return 1;
+		buf = affs_bget(data, block);
+		if (!buf) {
+			affs_atomic_add(&info.errstat.dcache, 1);
+			res = 1;
+			break;
+		}
+		if (affs_check_dcache(dir, block, buf, &block)) {
+			res = 1;
+			break;
 		}
-		if (be32_to_cpu(head->own_key) != block)
-			affs_error("dcache entry %d has key\n", block);
-		affs_print(2, " [%u]", block);
-		affs_alloc_block(block);
-		block = be32_to_cpu(head->next);
+		printed = 1;
 	}
-	affs_print(2, "\n");
-	return 0;
+	/* end the line of the blocks, nothing is printed for a missing chain */
+	if (printed)
+		affs_print(2, "\n");
+	return res;
 }
 
-int affs_read_dir(u32 *hashtable)
+/*
+ * Entries found in the wrong hash chain of their directory. They are
+ * still checked like every other entry, but can't be found by name, so
+ * they are moved to the right chain after the walk (see affs_fix_hash).
+ */
+struct affs_hash_fix {
+	u32 dir;
+	u32 entry;
+	/* chain it was found in and chain it belongs to */
+	u32 from, to;
+};
+
+static struct affs_hash_fix *affs_hash_fixes;
+static u32 affs_hash_fix_cnt, affs_hash_fix_size;
+#if HAVE_LIBPTHREAD
+static pthread_mutex_t affs_hash_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* remember the entry to be moved, it's left where it is if there's no memory */
+static void affs_hash_add(u32 dir, u32 entry, u32 from, u32 to)
 {
+	struct affs_hash_fix *fix;
+	u32 size;
+
+#if HAVE_LIBPTHREAD
+	pthread_mutex_lock(&affs_hash_lock);
+#endif
+	if (affs_hash_fix_cnt == affs_hash_fix_size) {
+		size = affs_hash_fix_size ? 2 * affs_hash_fix_size : 16;
+		fix = realloc(affs_hash_fixes, size * sizeof(*fix));
+		if (!fix) {
+			affs_error("unable to allocate hash chain list, dir entry %u isn't moved\n",
+				   entry);
+			goto out;
+		}
+		affs_hash_fixes = fix;
+		affs_hash_fix_size = size;
+	}
+	fix = &affs_hash_fixes[affs_hash_fix_cnt++];
+	fix->dir = dir;
+	fix->entry = entry;
+	fix->from = from;
+	fix->to = to;
+out:
+#if HAVE_LIBPTHREAD
+	pthread_mutex_unlock(&affs_hash_lock);
+#endif
+}
+
+/*
+ * Entries found outside of their own hash chain, i.e. in another directory
+ * (a cross link, unless their parent is wrong) or in the wrong chain of
+ * their directory. Which of them is checked, and where, would depend on
+ * the order of the walk, so they are only checked after the walk in block
+ * order (see affs_read_late): an entry found in its own chain as well is a
+ * cross link, any other one is checked where it was found first.
+ */
+struct affs_late_entry {
 	u32 entry;
-	u8 buf[AFFS_BLOCKSIZE_MAX];
-	int i;
+	u32 dir;
+	u32 bucket;
+	/* depth of dir */
+	u32 depth;
+};
 
-	for (i = 0; i < AFFS_HASHTABLESIZE; ++i) {
-		entry = be32_to_cpu(hashtable[i]);
-		while (entry) {
-			affs_bread(buf, entry);
-			if (affs_checksum(buf)) {
-				affs_error("dir entry %d has invalid checksum (%x)\n", entry, affs_checksum(buf));
-				entry = 0;
-				continue;
-			}
-			if (be32_to_cpu(AFFS_PTYPE(buf)) != T_SHORT) {
-				affs_error("dir entry %d has invalid primary type %d\n",
-					entry, be32_to_cpu(AFFS_PTYPE(buf)));
-				entry = 0;
+static struct affs_late_entry *affs_late_entries;
+static u32 affs_late_cnt, affs_late_size;
+/* set while they are checked */
+static int affs_late;
+#if HAVE_LIBPTHREAD
+static pthread_mutex_t affs_late_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*
+ * remember the entry for later, if that fails it isn't checked at all and
+ * the new bitmap is incomplete
+ */
+static void affs_late_add(u32 dir, u32 bucket, u32 entry, u32 depth)
+{
+	static int nomem;
+	struct affs_late_entry *l;
+	u32 size;
+
+#if HAVE_LIBPTHREAD
+	pthread_mutex_lock(&affs_late_lock);
+#endif
+	if (affs_late_cnt == affs_late_size) {
+		size = affs_late_size ? 2 * affs_late_size : 16;
+		l = realloc(affs_late_entries, size * sizeof(*l));
+		if (!l) {
+			if (!nomem++)
+				affs_error("unable to allocate entry list, the tree isn't checked completely\n");
+			affs_atomic_add(&info.errstat.bitmap_missing, 1);
+			goto out;
+		}
+		affs_late_entries = l;
+		affs_late_size = size;
+	}
+	l = &affs_late_entries[affs_late_cnt++];
+	l->entry = entry;
+	l->dir = dir;
+	l->bucket = bucket;
+	l->depth = depth;
+out:
+#if HAVE_LIBPTHREAD
+	pthread_mutex_unlock(&affs_late_lock);
+#endif
+}
+
+/*
+ * Check the header block entry (read into buf) found in hash chain bucket
+ * of directory dir at depth, print it and mark it allocated. Returns the
+ * next entry of the hash chain, *type is set to the secondary type of the
+ * entry or to 0 if it isn't valid or is checked later (the rest of the
+ * chain is skipped then).
+ */
+static u32 affs_check_entry(u32 dir, u32 bucket, u32 depth, u32 entry, u8 *buf, s32 *type)
+{
+	u32 sum, hash, parent;
+	s32 stype;
+	int res;
+
+	*type = 0;
+	sum = affs_checksum(buf);
+	if (sum) {
+		affs_error("dir entry %d has invalid checksum (%x)\n", entry, sum);
+		return 0;
+	}
+	if (be32_to_cpu(AFFS_PTYPE(buf)) != T_SHORT) {
+		affs_error("dir entry %d has invalid primary type %d\n",
+			entry, be32_to_cpu(AFFS_PTYPE(buf)));
+		return 0;
+	}
+	stype = be32_to_cpu(AFFS_STYPE(buf));
+	switch (stype) {
+	case ST_ROOT:
+		affs_error("dir entry %d has root type\n", entry);
+		return 0;
+	case ST_USERDIR:
+	case ST_SOFTLINK:
+	case ST_LINKDIR:
+	case ST_LINKFILE:
+	case ST_FILE:
+		break;
+	default:
+		affs_error("dir entry %d has invalid secondary type %d\n", entry, stype);
+		return 0;
+	}
+
+	/* file_name and parent are at the same place in all tails */
+	hash = affs_name_hash(AFFS_FILE_TAIL(buf)->file_name);
+	parent = be32_to_cpu(AFFS_FILE_TAIL(buf)->parent);
+	if (!affs_late && (hash != bucket || parent != dir)) {
+		affs_late_add(dir, bucket, entry, depth);
+		return 0;
+	}
+
+	/*
+	 * An entry seen before is a loop (or a cross link, see above), don't
+	 * follow it again. In its own chain the entry is still followed, if
+	 * its block is used by another file as well.
+	 */
+	res = affs_claim_block(entry, dir);
+	if (res == 1 || res == 3 || (res && affs_late))
+		return 0;
+	affs_inode_add(dir, entry, buf);
+	/* an entry of another directory is a cross link, moving it wouldn't help */
+	if (hash != bucket && parent == dir) {
+		affs_error("dir entry %u is in hash chain %u of directory %u instead of %u\n",
+			   entry, bucket, dir, hash);
+		affs_hash_add(dir, entry, bucket, hash);
+	}
+
+	switch (stype) {
+	case ST_USERDIR: {
+		struct affs_dir_head *head = AFFS_DIR_HEAD(buf);
+		if (be32_to_cpu(head->own_key) != entry) {
+			affs_error("wrong header key (%u, %u)\n", be32_to_cpu(head->own_key), entry);
+		}
+		affs_print_dir(buf);
+		break;
+	}
+	case ST_SOFTLINK:
+	case ST_LINKDIR:
+	case ST_LINKFILE:
+		affs_print_link(buf);
+		break;
+	case ST_FILE: {
+		struct affs_file_head *head = AFFS_FILE_HEAD(buf);
+		struct affs_file_tail *tail = AFFS_FILE_TAIL(buf);
+		if (be32_to_cpu(head->own_key) != entry)
+			affs_error("wrong header key (%u, %u)\n", be32_to_cpu(head->own_key), entry);
+		affs_bprefetch(&tail->extension, 1);
+		affs_print_file(buf);
+		break;
+	}
+	}
+	*type = stype;
+	/* hash_chain is at the same place in all tails */
+	return be32_to_cpu(AFFS_DIR_TAIL(buf)->hash_chain);
+}
+
+/*
+ * returns 1 (after complaining) if the directory entry at depth mustn't
+ * be entered, the blocks below it aren't marked in the new bitmap then.
+ */
+static int affs_check_depth(u32 entry, u32 depth)
+{
+	if (depth <= info.maxdepth)
+		return 0;
+	affs_error("directory %u exceeds the depth limit of %u\n", entry, info.maxdepth);
+	affs_atomic_add(&info.errstat.bitmap_missing, 1);
+	return 1;
+}
+
+/*
+ * The directory tree is walked depth first without recursion, the state
+ * of every level is kept on an explicit stack: the directory block, the
+ * current hash bucket and the next entry of its hash chain. Directory
+ * blocks are kept in a small pool of buffers, a level whose buffer was
+ * reused by a deeper level rereads its block when the walk returns to it.
+ * Buffer 0 always holds the hash table the walk was started with.
+ */
+#define AFFS_DIR_BUFS		16
+
+struct affs_dir_level {
+	u32 block;
+	u32 bucket;
+	u32 entry;
+};
+
+static struct affs_dir_level *affs_dir_stack;
+static u32 affs_dir_size;
+static u8 affs_dir_pool[AFFS_DIR_BUFS][AFFS_BLOCKSIZE_MAX];
+/* hash table in every buffer and the level it belongs to */
+static u32 *affs_dir_table[AFFS_DIR_BUFS];
+static u32 affs_dir_owner[AFFS_DIR_BUFS];
+
+static u32 affs_dir_slot(u32 depth)
+{
+	return depth ? 1 + (depth - 1) % (AFFS_DIR_BUFS - 1) : 0;
+}
+
+/* get the hash table of the directory at depth, NULL if it can't be reread */
+static u32 *affs_dir_get(u32 depth)
+{
+	u32 slot = affs_dir_slot(depth);
+	u8 *buf;
+
+	if (affs_dir_owner[slot] == depth)
+		return affs_dir_table[slot];
+	buf = affs_bget(affs_dir_pool[slot], affs_dir_stack[depth].block);
+	if (!buf)
+		return NULL;
+	affs_dir_table[slot] = AFFS_DIR_HEAD(buf)->hashtable;
+	affs_dir_owner[slot] = depth;
+	return affs_dir_table[slot];
+}
+
+/*
+ * make room for the directory block at depth, like the depth limit the
+ * directory isn't entered if that fails and the new bitmap is incomplete
+ */
+static int affs_dir_grow(u32 block, u32 depth)
+{
+	struct affs_dir_level *lvl;
+	u32 size;
+
+	if (depth < affs_dir_size)
+		return 0;
+	size = affs_dir_size ? 2 * affs_dir_size : 64;
+	lvl = realloc(affs_dir_stack, size * sizeof(*lvl));
+	if (!lvl) {
+		affs_error("unable to allocate directory stack, directory %u isn't checked\n",
+			   block);
+		affs_atomic_add(&info.errstat.bitmap_missing, 1);
+		return -1;
+	}
+	affs_dir_stack = lvl;
+	affs_dir_size = size;
+	return 0;
+}
+
+/* enter the directory with the given hash table at depth (see affs_dir_grow) */
+static void affs_dir_enter(u32 depth, u32 block, u32 *hashtable)
+{
+	struct affs_dir_level *lvl;
+	u32 slot = affs_dir_slot(depth);
+
+	affs_dir_table[slot] = hashtable;
+	affs_dir_owner[slot] = depth;
+
+	lvl = &affs_dir_stack[depth];
+	lvl->block = block;
+	lvl->bucket = 0;
+	lvl->entry = be32_to_cpu(hashtable[0]);
+	/* get all entries of this directory on the way at once */
+	affs_bprefetch(hashtable, AFFS_HASHTABLESIZE);
+}
+
+/* walk the directory dir with the given hash table at depth base */
+int affs_read_dir(u32 dir, u32 *hashtable, u32 base)
+{
+	struct affs_dir_level *lvl;
+	u8 data[AFFS_BLOCKSIZE_MAX], *buf;
+	u32 depth = 0, entry, slot;
+	s32 type;
+
+	for (slot = 0; slot < AFFS_DIR_BUFS; ++slot)
+		affs_dir_owner[slot] = -1;
+	if (affs_dir_grow(dir, 0))
+		return 1;
+	affs_dir_enter(0, dir, hashtable);
+
+	for (;;) {
+		lvl = &affs_dir_stack[depth];
+		entry = lvl->entry;
+		if (!entry) {
+			if (++lvl->bucket < AFFS_HASHTABLESIZE) {
+				hashtable = affs_dir_get(depth);
+				if (hashtable)
+					lvl->entry = be32_to_cpu(hashtable[lvl->bucket]);
+				else
+					lvl->bucket = AFFS_HASHTABLESIZE;
 				continue;
 			}
-			switch (be32_to_cpu(AFFS_STYPE(buf))) {
-			case ST_ROOT:
-				affs_error("dir entry %d has root type\n", entry);
-				entry = 0;
+			if (!depth--)
 				break;
-			case ST_USERDIR: {
-				struct affs_dir_head *head = AFFS_DIR_HEAD(buf);
-				struct affs_dir_tail *tail = AFFS_DIR_TAIL(buf);
-				if (be32_to_cpu(head->own_key) != entry) {
-					affs_error("wrong header key (%u, %u)\n", be32_to_cpu(head->own_key), entry);
-				}
-				affs_print_dir(buf);
-				affs_alloc_block(entry);
-				if (info.dcache)
-					affs_read_dcache(be32_to_cpu(tail->dcache));
-				entry = be32_to_cpu(tail->hash_chain);
-				affs_read_dir(head->hashtable);
+			continue;
+		}
+
+		buf = affs_bget(data, entry);
+		if (!buf) {
+			lvl->entry = 0;
+			continue;
+		}
+		lvl->entry = affs_check_entry(lvl->block, lvl->bucket, base + depth, entry,
+					      buf, &type);
+		switch (type) {
+		case ST_USERDIR:
+			if (info.dcache)
+				affs_read_dcache(entry, be32_to_cpu(AFFS_DIR_TAIL(buf)->dcache));
+			if (affs_check_depth(entry, base + depth + 1) ||
+			    affs_dir_grow(entry, depth + 1))
 				break;
+			/* a block of the mapped device stays where it is */
+			slot = affs_dir_slot(++depth);
+			if (buf == data) {
+				memcpy(affs_dir_pool[slot], data, info.blocksize);
+				buf = affs_dir_pool[slot];
 			}
-			case ST_SOFTLINK: {
-				struct affs_dir_tail *tail = AFFS_DIR_TAIL(buf);
-				affs_print_link(buf);
-				affs_alloc_block(entry);
-				entry = be32_to_cpu(tail->hash_chain);
-				break;
+			affs_dir_enter(depth, entry, AFFS_DIR_HEAD(buf)->hashtable);
+			break;
+		case ST_FILE:
+			affs_read_file(entry, buf);
+			break;
+		}
+	}
+
+	free(affs_dir_stack);
+	affs_dir_stack = NULL;
+	affs_dir_size = 0;
+	return 0;
+}
+
+/*
+ * sorted directory walk (elevator mode)
+ *
+ * Instead of following the tree depth first, all header, extension and
+ * dcache blocks found so far are kept in a priority queue and the queue
+ * is processed in block order. Blocks below the current position are
+ * postponed to the next sweep, so the device is scanned in one
+ * direction like an elevator does (the hash table entries of a
+ * directory are usually located after it). The same checks are done as
+ * by the recursive walk, only the order of the output differs.
+ */
+
+enum { AFFS_WALK_ENTRY, AFFS_WALK_EXT, AFFS_WALK_DCACHE };
+
+struct affs_walk_item {
+	/* sweep # (upper 32 bits) and block */
+	u64 key;
+	/* directory of an entry or a dcache block, file of an extension */
+	u32 owner;
+	/*
+	 * depth of the directory and the hash chain of an entry, or the # of
+	 * data blocks still expected and the last data block for an extension
+	 */
+	u32 cnt, last;
+	int type;
+};
+
+static struct affs_walk_item *affs_walk_queue;
+static u32 affs_walk_cnt, affs_walk_size;
+/* current position of the elevator */
+static u64 affs_walk_pos;
+
+/*
+ * queue the block, if the queue can't grow the block is dropped (its
+ * part of the tree isn't checked) and the new bitmap is incomplete
+ */
+static void affs_walk_push(u32 block, int type, u32 owner, u32 cnt, u32 last)
+{
+	static int nomem;
+	struct affs_walk_item item, *q;
+	u64 key;
+	u32 i, j, size;
+
+	if (!block)
+		return;
+	if (affs_walk_cnt == affs_walk_size) {
+		size = affs_walk_size ? 2 * affs_walk_size : 1024;
+		q = realloc(affs_walk_queue, size * sizeof(*q));
+		if (!q) {
+			if (!nomem++)
+				affs_error("unable to allocate walk queue, the tree isn't checked completely\n");
+			affs_atomic_add(&info.errstat.bitmap_missing, 1);
+			return;
+		}
+		affs_walk_queue = q;
+		affs_walk_size = size;
+	}
+	q = affs_walk_queue;
+
+	key = (affs_walk_pos & ~0xffffffffULL) | block;
+	if (key < affs_walk_pos)
+		key += 1ULL << 32;
+	item.key = key;
+	item.type = type;
+	item.owner = owner;
+	item.cnt = cnt;
+	item.last = last;
+
+	for (i = affs_walk_cnt++; i > 0; i = j) {
+		j = (i - 1) / 2;
+		if (q[j].key <= key)
+			break;
+		q[i] = q[j];
+	}
+	q[i] = item;
+}
+
+static void affs_walk_pop(struct affs_walk_item *item)
+{
+	struct affs_walk_item *q = affs_walk_queue, last;
+	u32 i, j, cnt;
+
+	*item = q[0];
+	affs_walk_pos = item->key;
+	cnt = --affs_walk_cnt;
+	if (!cnt)
+		return;
+	last = q[cnt];
+	for (i = 0; (j = 2 * i + 1) < cnt; i = j) {
+		if (j + 1 < cnt && q[j + 1].key < q[j].key)
+			j++;
+		if (last.key <= q[j].key)
+			break;
+		q[i] = q[j];
+	}
+	q[i] = last;
+}
+
+static void affs_walk_dir(u32 dir, u32 *hashtable, u32 depth)
+{
+	int i;
+
+	affs_bprefetch(hashtable, AFFS_HASHTABLESIZE);
+	for (i = 0; i < AFFS_HASHTABLESIZE; ++i)
+		affs_walk_push(be32_to_cpu(hashtable[i]), AFFS_WALK_ENTRY, dir, depth, i);
+}
+
+static int affs_walk_sorted(u32 dir, u32 *hashtable, u32 dcache)
+{
+	struct affs_walk_item item;
+	u8 data[AFFS_BLOCKSIZE_MAX], *buf;
+	u32 block, next, block_cnt, last;
+	s32 type;
+	int res;
+
+	affs_walk_pos = 0;
+	if (info.dcache)
+		affs_walk_push(dcache, AFFS_WALK_DCACHE, dir, 0, 0);
+	affs_walk_dir(dir, hashtable, 0);
+
+	while (affs_walk_cnt) {
+		affs_walk_pop(&item);
+		block = (u32)item.key;
+		buf = affs_bget(data, block);
+		if (!buf) {
+			if (item.type == AFFS_WALK_DCACHE)
+				affs_atomic_add(&info.errstat.dcache, 1);
+			continue;
+		}
+		switch (item.type) {
+		case AFFS_WALK_ENTRY:
+			next = affs_check_entry(item.owner, item.last, item.cnt, block, buf, &type);
+			affs_walk_push(next, AFFS_WALK_ENTRY, item.owner, item.cnt, item.last);
+			if (type == ST_USERDIR) {
+				if (info.dcache)
+					affs_walk_push(be32_to_cpu(AFFS_DIR_TAIL(buf)->dcache),
+						       AFFS_WALK_DCACHE, block, 0, 0);
+				if (!affs_check_depth(block, item.cnt + 1))
+					affs_walk_dir(block, AFFS_DIR_HEAD(buf)->hashtable, item.cnt + 1);
+			} else if (type == ST_FILE) {
+				block_cnt = (be32_to_cpu(AFFS_FILE_TAIL(buf)->byte_size) +
+					     info.datablocksize - 1) / info.datablocksize;
+				next = affs_read_blocks(block, block, buf, &block_cnt, &last);
+				affs_walk_push(next, AFFS_WALK_EXT, block, block_cnt, last);
+				affs_print(2, "\n");
 			}
-			case ST_LINKDIR: {
-				struct affs_dir_tail *tail = AFFS_DIR_TAIL(buf);
-				affs_print_link(buf);
-				affs_alloc_block(entry);
-				entry = be32_to_cpu(tail->hash_chain);
+			break;
+		case AFFS_WALK_EXT:
+			block_cnt = item.cnt;
+			res = affs_check_ext(item.owner, block, block_cnt, item.last);
+			if (res == 2)
 				break;
+			next = affs_read_blocks(item.owner, block, buf, &block_cnt, &last);
+			if (!res)
+				affs_walk_push(next, AFFS_WALK_EXT, item.owner, block_cnt, last);
+			affs_print(2, "\n");
+			break;
+		case AFFS_WALK_DCACHE:
+			if (!affs_check_dcache(item.owner, block, buf, &next))
+				affs_walk_push(next, AFFS_WALK_DCACHE, item.owner, 0, 0);
+			affs_print(2, "\n");
+			break;
+		}
+	}
+
+	free(affs_walk_queue);
+	affs_walk_queue = NULL;
+	affs_walk_size = 0;
+	return 0;
+}
+
+#if HAVE_LIBPTHREAD
+/*
+ * parallel directory walk
+ *
+ * The tree is split into tasks: a hash chain of a directory, the block
+ * list of a file with extension blocks and a dcache chain. A task
+ * creates new tasks for what it finds (e.g. for the hash chains of a
+ * subdirectory), which are put into the queue of the worker thread
+ * running it. Every worker takes its most recent task first and only if
+ * it runs out of work, it steals the oldest task of another worker.
+ * The output of a task is collected in its buffer and the position of
+ * the output of its subtasks is remembered, so the main thread can
+ * print everything in the order of the recursive walk.
+ */
+
+enum { AFFS_TASK_ROOT, AFFS_TASK_CHAIN, AFFS_TASK_FILE, AFFS_TASK_DCACHE };
+
+struct affs_task;
+
+struct affs_subtask {
+	/* position of its output in the output of the parent */
+	size_t pos;
+	struct affs_task *task;
+};
+
+struct affs_task {
+	int type;
+	u32 block;
+	/* directory of a hash chain or a dcache chain, its depth and the hash chain */
+	u32 dir, depth, bucket;
+	struct affs_task *parent;
+	struct affs_output out;
+	struct affs_subtask *sub;
+	u32 sub_cnt, sub_size;
+	/* how much of the output was printed (see affs_walk_print) */
+	u32 sub_done;
+	size_t pos;
+	int done;
+};
+
+struct affs_worker {
+	pthread_mutex_t lock;
+	/* queued tasks are task[first..last) */
+	struct affs_task **task;
+	u32 first, last, size;
+	pthread_t thread;
+};
+
+static struct affs_worker affs_workers[AFFS_THREADS_MAX];
+static u32 affs_worker_cnt;
+
+/* protects the counters below and the done flag of the tasks */
+static pthread_mutex_t affs_walk_lock = PTHREAD_MUTEX_INITIALIZER;
+/* signaled when a task is queued or all tasks are done */
+static pthread_cond_t affs_walk_work = PTHREAD_COND_INITIALIZER;
+/* signaled when a task is done */
+static pthread_cond_t affs_walk_done = PTHREAD_COND_INITIALIZER;
+/* # of queued tasks and # of tasks not done yet */
+static u32 affs_walk_queued, affs_walk_pending;
+
+/*
+ * Like realloc, but a failure is reported (once). The task isn't created
+ * then, so its part of the tree isn't checked and the new bitmap is
+ * incomplete (like the depth limit).
+ */
+static void *affs_walk_alloc(void *ptr, size_t size)
+{
+	static int nomem;
+
+	ptr = realloc(ptr, size);
+	if (!ptr) {
+		if (!nomem++)
+			affs_error("unable to allocate walk task, the tree isn't checked completely\n");
+		affs_atomic_add(&info.errstat.bitmap_missing, 1);
+	}
+	return ptr;
+}
+
+/* queue a new task of the given type, its output follows the current output of parent */
+static void affs_task_add(struct affs_worker *w, struct affs_task *parent, int type,
+			  u32 block, u32 dir, u32 depth, u32 bucket)
+{
+	struct affs_task *t, **task;
+	struct affs_subtask *sub;
+	u32 size;
+
+	t = affs_walk_alloc(NULL, sizeof(*t));
+	if (!t)
+		return;
+	if (parent->sub_cnt == parent->sub_size) {
+		size = parent->sub_size ? 2 * parent->sub_size : 8;
+		sub = affs_walk_alloc(parent->sub, size * sizeof(*sub));
+		if (!sub)
+			goto fail;
+		parent->sub = sub;
+		parent->sub_size = size;
+	}
+	/* only w itself adds tasks to its queue, so the room is kept */
+	pthread_mutex_lock(&w->lock);
+	if (w->last == w->size) {
+		if (w->first) {
+			memmove(w->task, w->task + w->first, (w->last - w->first) * sizeof(*w->task));
+			w->last -= w->first;
+			w->first = 0;
+		} else {
+			size = w->size ? 2 * w->size : 256;
+			task = affs_walk_alloc(w->task, size * sizeof(*w->task));
+			if (!task) {
+				pthread_mutex_unlock(&w->lock);
+				goto fail;
 			}
-			case ST_FILE: {
-				struct affs_file_head *head = AFFS_FILE_HEAD(buf);
-				struct affs_file_tail *tail = AFFS_FILE_TAIL(buf);
-				if (be32_to_cpu(head->own_key) != entry)
-					affs_error("wrong header key (%u, %u)\n", be32_to_cpu(head->own_key), entry);
-				affs_print_file(buf);
-				affs_alloc_block(entry);
-				entry = be32_to_cpu(tail->hash_chain);
-				affs_read_file(buf);
+			w->task = task;
+			w->size = size;
+		}
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	memset(t, 0, sizeof(*t));
+	t->type = type;
+	t->block = block;
+	t->dir = dir;
+	t->depth = depth;
+	t->bucket = bucket;
+	t->parent = parent;
+
+	sub = &parent->sub[parent->sub_cnt++];
+	sub->pos = parent->out.len;
+	sub->task = t;
+
+	/* count it first, so affs_walk_queued can't drop below zero */
+	pthread_mutex_lock(&affs_walk_lock);
+	affs_walk_queued++;
+	affs_walk_pending++;
+	pthread_cond_signal(&affs_walk_work);
+	pthread_mutex_unlock(&affs_walk_lock);
+
+	pthread_mutex_lock(&w->lock);
+	w->task[w->last++] = t;
+	pthread_mutex_unlock(&w->lock);
+	return;
+fail:
+	free(t);
+}
+
+/* get the next task for worker w, NULL if there is nothing to do right now */
+static struct affs_task *affs_task_get(struct affs_worker *w)
+{
+	struct affs_worker *v;
+	struct affs_task *t = NULL;
+	u32 i;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->last > w->first)
+		t = w->task[--w->last];
+	pthread_mutex_unlock(&w->lock);
+
+	for (i = 1; !t && i < affs_worker_cnt; ++i) {
+		v = &affs_workers[(w - affs_workers + i) % affs_worker_cnt];
+		pthread_mutex_lock(&v->lock);
+		if (v->last > v->first)
+			t = v->task[v->first++];
+		pthread_mutex_unlock(&v->lock);
+	}
+
+	if (t) {
+		pthread_mutex_lock(&affs_walk_lock);
+		affs_walk_queued--;
+		pthread_mutex_unlock(&affs_walk_lock);
+	}
+	return t;
+}
+
+/* queue the hash chains of the directory dir at depth */
+static void affs_task_dir(struct affs_worker *w, struct affs_task *t, u32 dir,
+			  u32 *hashtable, u32 depth)
+{
+	u32 entry;
+	int i;
+
+	affs_bprefetch(hashtable, AFFS_HASHTABLESIZE);
+	for (i = 0; i < AFFS_HASHTABLESIZE; ++i) {
+		entry = be32_to_cpu(hashtable[i]);
+		if (entry)
+			affs_task_add(w, t, AFFS_TASK_CHAIN, entry, dir, depth, i);
+	}
+}
+
+static void affs_task_run(struct affs_worker *w, struct affs_task *t)
+{
+	u8 data[AFFS_BLOCKSIZE_MAX], *buf;
+	u32 entry, next, dcache;
+	s32 type;
+
+	switch (t->type) {
+	case AFFS_TASK_CHAIN:
+		for (entry = t->block; entry; entry = next) {
+			buf = affs_bget(data, entry);
+			if (!buf)
 				break;
-			}
-			case ST_LINKFILE: {
-				struct affs_file_tail *tail = AFFS_FILE_TAIL(buf);
-				affs_print_link(buf);
-				affs_alloc_block(entry);
-				entry = be32_to_cpu(tail->hash_chain);
+			next = affs_check_entry(t->dir, t->bucket, t->depth, entry, buf, &type);
+			switch (type) {
+			case ST_USERDIR:
+				dcache = be32_to_cpu(AFFS_DIR_TAIL(buf)->dcache);
+				if (info.dcache && dcache)
+					affs_task_add(w, t, AFFS_TASK_DCACHE, dcache, entry, 0, 0);
+				if (!affs_check_depth(entry, t->depth + 1))
+					affs_task_dir(w, t, entry, AFFS_DIR_HEAD(buf)->hashtable,
+						      t->depth + 1);
+				break;
+			case ST_FILE:
+				/* only files with extension blocks are worth a task */
+				if (AFFS_FILE_TAIL(buf)->extension)
+					affs_task_add(w, t, AFFS_TASK_FILE, entry, 0, 0, 0);
+				else
+					affs_read_file(entry, buf);
 				break;
 			}
+		}
+		break;
+	case AFFS_TASK_FILE:
+		buf = affs_bget(data, t->block);
+		if (buf)
+			affs_read_file(t->block, buf);
+		break;
+	case AFFS_TASK_DCACHE:
+		affs_read_dcache(t->dir, t->block);
+		break;
+	}
+}
+
+static void *affs_walk_worker(void *arg)
+{
+	struct affs_worker *w = arg;
+	struct affs_task *t;
+
+	for (;;) {
+		t = affs_task_get(w);
+		if (!t) {
+			pthread_mutex_lock(&affs_walk_lock);
+			while (!affs_walk_queued && affs_walk_pending)
+				pthread_cond_wait(&affs_walk_work, &affs_walk_lock);
+			if (!affs_walk_pending) {
+				pthread_mutex_unlock(&affs_walk_lock);
+				break;
 			}
+			pthread_mutex_unlock(&affs_walk_lock);
+			continue;
+		}
+
+		affs_set_output(&t->out);
+		affs_task_run(w, t);
+		affs_set_output(NULL);
+
+		pthread_mutex_lock(&affs_walk_lock);
+		t->done = 1;
+		if (!--affs_walk_pending)
+			pthread_cond_broadcast(&affs_walk_work);
+		pthread_cond_broadcast(&affs_walk_done);
+		pthread_mutex_unlock(&affs_walk_lock);
+	}
+	return NULL;
+}
+
+/*
+ * Print the output of the task tree in order, while it's still created.
+ * Every task is freed as soon as its output (and that of its subtasks)
+ * is printed.
+ */
+static void affs_walk_print(struct affs_task *t)
+{
+	struct affs_task *parent;
+	struct affs_subtask *sub;
+
+	while (t) {
+		pthread_mutex_lock(&affs_walk_lock);
+		while (!t->done)
+			pthread_cond_wait(&affs_walk_done, &affs_walk_lock);
+		pthread_mutex_unlock(&affs_walk_lock);
+
+		if (t->sub_done < t->sub_cnt) {
+			sub = &t->sub[t->sub_done++];
+			if (sub->pos > t->pos)
+				affs_write(t->out.buf + t->pos, sub->pos - t->pos);
+			t->pos = sub->pos;
+			t = sub->task;
+			continue;
+		}
+		if (t->out.len > t->pos)
+			affs_write(t->out.buf + t->pos, t->out.len - t->pos);
+		parent = t->parent;
+		free(t->out.buf);
+		free(t->sub);
+		free(t);
+		t = parent;
+	}
+}
+
+static int affs_walk_threads(u32 dir, u32 *hashtable, u32 dcache)
+{
+	struct affs_task *root;
+	struct affs_worker *w;
+	u32 i;
+
+	/* without memory for the root task the tree is walked without threads */
+	root = calloc(1, sizeof(*root));
+	if (!root) {
+		if (info.dcache)
+			affs_read_dcache(dir, dcache);
+		return affs_read_dir(dir, hashtable, 0);
+	}
+	root->type = AFFS_TASK_ROOT;
+	root->done = 1;
+
+	affs_worker_cnt = info.jobs;
+	for (i = 0; i < affs_worker_cnt; ++i) {
+		w = &affs_workers[i];
+		memset(w, 0, sizeof(*w));
+		pthread_mutex_init(&w->lock, NULL);
+	}
+	affs_walk_queued = affs_walk_pending = 0;
+	if (info.dcache && dcache)
+		affs_task_add(&affs_workers[0], root, AFFS_TASK_DCACHE, dcache, dir, 0, 0);
+	affs_task_dir(&affs_workers[0], root, dir, hashtable, 0);
+
+	for (i = 0; i < affs_worker_cnt; ++i) {
+		if (pthread_create(&affs_workers[i].thread, NULL, affs_walk_worker, &affs_workers[i]))
+			break;
+	}
+	if (!i) {
+		/* no thread, so do it ourselves */
+		affs_worker_cnt = 1;
+		affs_walk_worker(&affs_workers[0]);
+	} else if (i < affs_worker_cnt) {
+		affs_print(1, "started only %u of %u threads\n", i, affs_worker_cnt);
+		/* the others may still steal from the missing workers */
+	}
+
+	affs_walk_print(root);
+
+	while (i-- > 0)
+		pthread_join(affs_workers[i].thread, NULL);
+	for (i = 0; i < affs_worker_cnt; ++i) {
+		free(affs_workers[i].task);
+		pthread_mutex_destroy(&affs_workers[i].lock);
+	}
+	return 0;
+}
+#endif
+
+/*
+ * Check the whole directory tree starting at the root block (which must
+ * be in affs_rootbuf), the used blocks are marked in the new bitmap.
+ */
+static int affs_walk_tree(void)
+{
+	u32 *hashtable = AFFS_ROOT_HEAD(affs_rootbuf)->hashtable;
+	u32 dcache = be32_to_cpu(AFFS_ROOT_TAIL(affs_rootbuf)->dcache);
+
+	if (info.elevator)
+		return affs_walk_sorted(info.root, hashtable, dcache);
+#if HAVE_LIBPTHREAD
+	/*
+	 * without the owner table a loop can't be told from a cross link (see
+	 * affs_claim_block), so what is checked would depend on the timing
+	 */
+	if (info.jobs > 1 && !info.lowmem)
+		return affs_walk_threads(info.root, hashtable, dcache);
+#endif
+
+	if (info.dcache)
+		affs_read_dcache(info.root, dcache);
+	return affs_read_dir(info.root, hashtable, 0);
+}
+
+static int affs_cmp_late(const void *a, const void *b)
+{
+	const struct affs_late_entry *x = a, *y = b;
+
+	if (x->entry != y->entry)
+		return x->entry < y->entry ? -1 : 1;
+	if (x->dir != y->dir)
+		return x->dir < y->dir ? -1 : 1;
+	return x->bucket < y->bucket ? -1 : x->bucket > y->bucket;
+}
+
+/*
+ * Check the entries found outside of their own hash chain (see
+ * affs_late_entry) and the rest of the chain after them. This is done
+ * without threads, so the first of them in block order gets the entry.
+ */
+static int affs_read_late(void)
+{
+	u32 hashtable[AFFS_HASHTABLESIZE];
+	struct affs_late_entry *l;
+	u32 i;
+	int res = 0;
+
+	if (!affs_late_cnt)
+		return 0;
+	qsort(affs_late_entries, affs_late_cnt, sizeof(*l), affs_cmp_late);
+	affs_late = 1;
+	for (i = 0; i < affs_late_cnt; ++i) {
+		l = &affs_late_entries[i];
+		memset(hashtable, 0, sizeof(hashtable));
+		hashtable[l->bucket] = cpu_to_be32(l->entry);
+		if (affs_read_dir(l->dir, hashtable, l->depth))
+			res = 1;
+	}
+	affs_late = 0;
+
+	free(affs_late_entries);
+	affs_late_entries = NULL;
+	affs_late_cnt = affs_late_size = 0;
+	return res;
+}
+
+/*
+ * Walk the directory tree, the errors found are counted in errstat.tree
+ * (the walk might not have reached every used block then), except the
+ * ones in the dcache chains, which are only counted in errstat.dcache.
+ * What would depend on the order of the walk (the entries outside of
+ * their own hash chain and the owners of a cross link) is only decided
+ * after it, so every kind of walk has the same result.
+ */
+int affs_read_tree(void)
+{
+	u32 errors = info.errstat.errors;
+	u32 dcache = info.errstat.dcache;
+	int res;
+
+	affs_cross_start();
+	res = affs_walk_tree();
+	if (affs_read_late())
+		res = 1;
+	affs_cross_report();
+	info.errstat.tree = (info.errstat.errors - errors) -
+			    (info.errstat.dcache - dcache);
+	return res;
+}
+
+/* set the hash chain link of the header block (or the directory table slot) at entry */
+static int affs_hash_link(u32 dir, u32 bucket, u32 entry, u32 next)
+{
+	u8 data[AFFS_BLOCKSIZE_MAX];
+
+	if (!entry) {
+		if (dir == info.root) {
+			/* written with the root block */
+			AFFS_ROOT_HEAD(affs_rootbuf)->hashtable[bucket] = cpu_to_be32(next);
+			return 0;
 		}
+		if (affs_bread(data, dir))
+			return 1;
+		AFFS_DIR_HEAD(data)->hashtable[bucket] = cpu_to_be32(next);
+		entry = dir;
+	} else {
+		if (affs_bread(data, entry))
+			return 1;
+		AFFS_DIR_TAIL(data)->hash_chain = cpu_to_be32(next);
 	}
+	AFFS_DIR_HEAD(data)->checksum = 0;
+	AFFS_DIR_HEAD(data)->checksum = cpu_to_be32(-affs_checksum(data));
+	return affs_bwrite(data, entry);
+}
+
+/* the block after entry in its hash chain (or the first one of the chain for 0) */
+static u32 affs_hash_next(u32 dir, u32 bucket, u32 entry)
+{
+	u8 data[AFFS_BLOCKSIZE_MAX], *buf;
+
+	if (!entry && dir == info.root)
+		return be32_to_cpu(AFFS_ROOT_HEAD(affs_rootbuf)->hashtable[bucket]);
+	buf = affs_bget(data, entry ? entry : dir);
+	if (!buf)
+		return 0;
+	if (!entry)
+		return be32_to_cpu(AFFS_DIR_HEAD(buf)->hashtable[bucket]);
+	return be32_to_cpu(AFFS_DIR_TAIL(buf)->hash_chain);
+}
+
+/*
+ * Move the entries found in the wrong hash chain to the right one (only
+ * with -w). An entry is unlinked from its chain and inserted into the
+ * new one in block order.
+ */
+int affs_fix_hash(void)
+{
+	struct affs_hash_fix *fix;
+	u32 i, prev, next, cur, steps;
+
+	if (!affs_hash_fix_cnt)
+		return 0;
+	affs_print(1, "%u entries in the wrong hash chain\n", affs_hash_fix_cnt);
+	if (!info.write || info.read)
+		goto out;
+
+	for (i = 0; i < affs_hash_fix_cnt; ++i) {
+		fix = &affs_hash_fixes[i];
+
+		/* find the predecessor in the old chain, 0 is the table slot */
+		prev = 0;
+		cur = affs_hash_next(fix->dir, fix->from, 0);
+		for (steps = 0; cur && cur != fix->entry && steps < info.blocks; ++steps) {
+			prev = cur;
+			cur = affs_hash_next(fix->dir, fix->from, cur);
+		}
+		if (cur != fix->entry)
+			continue;
+		next = affs_hash_next(fix->dir, fix->from, cur);
+		if (affs_hash_link(fix->dir, fix->from, prev, next))
+			continue;
+
+		prev = 0;
+		cur = affs_hash_next(fix->dir, fix->to, 0);
+		for (steps = 0; cur && cur < fix->entry && steps < info.blocks; ++steps) {
+			prev = cur;
+			cur = affs_hash_next(fix->dir, fix->to, cur);
+		}
+		if (affs_hash_link(fix->dir, fix->to, fix->entry, cur) ||
+		    affs_hash_link(fix->dir, fix->to, prev, fix->entry))
+			continue;
+		affs_print(1, "moved dir entry %u to hash chain %u\n", fix->entry, fix->to);
+	}
+
+out:
+	free(affs_hash_fixes);
+	affs_hash_fixes = NULL;
+	affs_hash_fix_cnt = affs_hash_fix_size = 0;
 	return 0;
 }
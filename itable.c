@@ -0,0 +1,345 @@
+/* 
+ *  Copyright (C) 2000  Roman Zippel
+ *  
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *  
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "affs_config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#if HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#include "amigaffs.h"
+
+/*
+ * inode table
+ *
+ * While the tree is walked, every header is decoded once into a small
+ * native endian record, so the checks done after the walk (and anything
+ * else that needs the headers again) can work from memory instead of
+ * reading the blocks again. The records are allocated in chunks that are
+ * never moved and the names and comments are interned in a common pool,
+ * where equal strings are stored only once. After the walk an index is built, which
+ * finds a record by its key and lists the records in key order.
+ * If the table can't grow, the error is reported once and the records
+ * are dropped, affs_inode_index() fails then and the check is aborted.
+ */
+
+/* # of records per chunk */
+#define AFFS_INODE_SHIFT	12
+#define AFFS_INODE_CHUNK	(1 << AFFS_INODE_SHIFT)
+
+static struct affs_inode **affs_inode_chunk;
+static u32 affs_inode_chunk_cnt, affs_inode_chunk_size;
+static u32 affs_inode_cnt;
+
+/* name pool and its hash set of string offsets (0 is a free slot) */
+static u8 *affs_name_pool;
+static u32 affs_name_len, affs_name_size;
+static u32 *affs_name_set;
+static u32 affs_name_mask, affs_name_cnt;
+#if HAVE_LIBPTHREAD
+static pthread_mutex_t affs_inode_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* the records in key order and the hash index of them (after the walk) */
+static u32 *affs_inode_order;
+static u32 *affs_inode_hash;
+static u32 affs_inode_mask;
+
+/* set if the table couldn't grow, it misses records then */
+static int affs_inode_nomem;
+
+/* like realloc, but the failure is reported (once), ptr is kept then */
+static void *affs_inode_alloc(void *ptr, size_t size)
+{
+	ptr = realloc(ptr, size);
+	if (!ptr && !affs_inode_nomem++)
+		affs_error("unable to allocate inode table\n");
+	return ptr;
+}
+
+#define affs_inode_at(i)	(&affs_inode_chunk[(i) >> AFFS_INODE_SHIFT][(i) & (AFFS_INODE_CHUNK - 1)])
+
+static u32 affs_name_hash_str(u8 *name)
+{
+	u32 hash = 2166136261U;
+	int i;
+
+	for (i = 0; i <= name[0]; ++i)
+		hash = (hash ^ name[i]) * 16777619;
+	return hash;
+}
+
+static int affs_name_rehash(void)
+{
+	u32 *set = affs_name_set, mask = affs_name_mask, i, j;
+
+	affs_name_set = affs_inode_alloc(NULL, ((mask ? 2 * mask + 1 : 1023) + 1) * sizeof(*set));
+	if (!affs_name_set) {
+		affs_name_set = set;
+		return -1;
+	}
+	affs_name_mask = mask ? 2 * mask + 1 : 1023;
+	memset(affs_name_set, 0, (affs_name_mask + 1) * sizeof(*set));
+	for (i = 0; set && i <= mask; ++i) {
+		if (!set[i])
+			continue;
+		for (j = affs_name_hash_str(affs_name_pool + set[i]) & affs_name_mask; affs_name_set[j];
+		     j = (j + 1) & affs_name_mask)
+			;
+		affs_name_set[j] = set[i];
+	}
+	free(set);
+	return 0;
+}
+
+/*
+ * offset of the name or comment (a BCPL string of up to max characters)
+ * in the pool, which is added if necessary, -1 if the pool can't grow
+ */
+static u32 affs_name_intern(u8 *name, u32 max)
+{
+	u8 str[AFFS_COMMENT_MAX + 1], *pool;
+	u32 j, len;
+
+	if (!affs_name_size) {
+		affs_name_pool = affs_inode_alloc(NULL, 65536);
+		if (!affs_name_pool)
+			return -1;
+		affs_name_size = 65536;
+		/* offset 0 marks a free slot, it's the empty name */
+		affs_name_pool[0] = 0;
+		affs_name_len = 1;
+	}
+	len = name[0] > max ? max : name[0];
+	if (!len)
+		return 0;
+	str[0] = len;
+	memcpy(str + 1, name + 1, len);
+
+	if (2 * (affs_name_cnt + 1) > affs_name_mask && affs_name_rehash())
+		return -1;
+	for (j = affs_name_hash_str(str) & affs_name_mask; affs_name_set[j];
+	     j = (j + 1) & affs_name_mask)
+		if (!memcmp(affs_name_pool + affs_name_set[j], str, len + 1))
+			return affs_name_set[j];
+
+	if (affs_name_len + len + 1 > affs_name_size) {
+		pool = affs_inode_alloc(affs_name_pool, 2 * affs_name_size);
+		if (!pool)
+			return -1;
+		affs_name_pool = pool;
+		affs_name_size *= 2;
+	}
+	affs_name_set[j] = affs_name_len;
+	affs_name_cnt++;
+	memcpy(affs_name_pool + affs_name_len, str, len + 1);
+	affs_name_len += len + 1;
+	return affs_name_set[j];
+}
+
+/* add the header entry (read into buf) found in directory dir to the table */
+void affs_inode_add(u32 dir, u32 entry, u8 *buf)
+{
+	struct affs_file_tail *tail = AFFS_FILE_TAIL(buf);
+	struct affs_inode *inode, **chunk;
+	u32 size, name, comment;
+
+#if HAVE_LIBPTHREAD
+	pthread_mutex_lock(&affs_inode_lock);
+#endif
+	if (affs_inode_nomem)
+		goto out;
+	if (!(affs_inode_cnt & (AFFS_INODE_CHUNK - 1))) {
+		if (affs_inode_chunk_cnt == affs_inode_chunk_size) {
+			size = affs_inode_chunk_size ? 2 * affs_inode_chunk_size : 64;
+			chunk = affs_inode_alloc(affs_inode_chunk, size * sizeof(*chunk));
+			if (!chunk)
+				goto out;
+			affs_inode_chunk = chunk;
+			affs_inode_chunk_size = size;
+		}
+		inode = affs_inode_alloc(NULL, AFFS_INODE_CHUNK * sizeof(*inode));
+		if (!inode)
+			goto out;
+		affs_inode_chunk[affs_inode_chunk_cnt++] = inode;
+	}
+	/* comment is at the same place in all tails */
+	name = affs_name_intern(tail->file_name, AFFS_NAME_MAX);
+	comment = affs_name_intern(tail->comment, AFFS_COMMENT_MAX);
+	if (name == (u32)-1 || comment == (u32)-1)
+		goto out;
+	inode = affs_inode_at(affs_inode_cnt);
+	affs_inode_cnt++;
+
+	inode->key = entry;
+	inode->type = be32_to_cpu(AFFS_STYPE(buf));
+	inode->parent = be32_to_cpu(tail->parent);
+	inode->dir = dir;
+	inode->size = inode->type == ST_FILE ? be32_to_cpu(tail->byte_size) : 0;
+	inode->protect = be32_to_cpu(tail->protect);
+	inode->days = be32_to_cpu(tail->file_change.days);
+	inode->mins = be32_to_cpu(tail->file_change.mins);
+	inode->ticks = be32_to_cpu(tail->file_change.ticks);
+	inode->extension = be32_to_cpu(tail->extension);
+	inode->original = be32_to_cpu(tail->original);
+	inode->link_chain = be32_to_cpu(tail->link_chain);
+	inode->name = name;
+	inode->comment = comment;
+	inode->flags = 0;
+out:
+#if HAVE_LIBPTHREAD
+	pthread_mutex_unlock(&affs_inode_lock);
+#endif
+}
+
+/* sort the record indices in order[0..cnt) by key (radix sort, 8 bits per pass) */
+static int affs_inode_sort(u32 *order, u32 cnt)
+{
+	u32 *tmp, *src = order, *dst, *swap;
+	u32 count[256], i, shift, sum, n;
+
+	tmp = affs_inode_alloc(NULL, (cnt ? cnt : 1) * sizeof(*tmp));
+	if (!tmp)
+		return -1;
+	dst = tmp;
+	for (shift = 0; shift < 32; shift += 8) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < cnt; ++i)
+			count[(affs_inode_at(src[i])->key >> shift) & 255]++;
+		for (i = sum = 0; i < 256; ++i) {
+			n = count[i];
+			count[i] = sum;
+			sum += n;
+		}
+		for (i = 0; i < cnt; ++i)
+			dst[count[(affs_inode_at(src[i])->key >> shift) & 255]++] = src[i];
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+	/* an even number of passes, the result is in order again */
+	free(tmp);
+	return 0;
+}
+
+#define affs_inode_slot(key)	(((key) * 2654435761U) & affs_inode_mask)
+
+/*
+ * build the index of the table, it mustn't change anymore after this,
+ * returns 1 if the table is incomplete
+ */
+int affs_inode_index(void)
+{
+	u32 i, j, size;
+
+	if (affs_inode_nomem)
+		return 1;
+	affs_inode_order = affs_inode_alloc(NULL, (affs_inode_cnt ? affs_inode_cnt : 1) *
+					    sizeof(*affs_inode_order));
+	if (!affs_inode_order)
+		return 1;
+	for (i = 0; i < affs_inode_cnt; ++i)
+		affs_inode_order[i] = i;
+	if (affs_inode_sort(affs_inode_order, affs_inode_cnt))
+		return 1;
+
+	for (size = 16; size < 2 * affs_inode_cnt; size <<= 1)
+		;
+	affs_inode_hash = affs_inode_alloc(NULL, size * sizeof(*affs_inode_hash));
+	if (!affs_inode_hash)
+		return 1;
+	affs_inode_mask = size - 1;
+	memset(affs_inode_hash, 0xff, size * sizeof(*affs_inode_hash));
+	for (i = 0; i < affs_inode_cnt; ++i) {
+		for (j = affs_inode_slot(affs_inode_at(i)->key); affs_inode_hash[j] != (u32)-1;
+		     j = (j + 1) & affs_inode_mask)
+			;
+		affs_inode_hash[j] = i;
+	}
+	return 0;
+}
+
+u32 affs_inode_count(void)
+{
+	return affs_inode_cnt;
+}
+
+/* the record with the i-th smallest key */
+struct affs_inode *affs_inode_nth(u32 i)
+{
+	return affs_inode_at(affs_inode_order[i]);
+}
+
+/* the record of the header block key, NULL if there is none */
+struct affs_inode *affs_inode_find(u32 key)
+{
+	struct affs_inode *inode;
+	u32 j;
+
+	for (j = affs_inode_slot(key); affs_inode_hash[j] != (u32)-1; j = (j + 1) & affs_inode_mask) {
+		inode = affs_inode_at(affs_inode_hash[j]);
+		if (inode->key == key)
+			return inode;
+	}
+	return NULL;
+}
+
+/* the name of the record as BCPL string */
+u8 *affs_inode_name(struct affs_inode *inode)
+{
+	return affs_name_pool + inode->name;
+}
+
+/* the comment of the record as BCPL string */
+u8 *affs_inode_comment(struct affs_inode *inode)
+{
+	return affs_name_pool + inode->comment;
+}
+
+void affs_inode_stat(void)
+{
+	if (!affs_inode_cnt)
+		return;
+	affs_print(1, "inode table: %u entries of %u bytes, "
+		   "%u different names and comments in %u bytes\n", affs_inode_cnt,
+		   (u32)sizeof(struct affs_inode), affs_name_cnt, affs_name_len);
+}
+
+void affs_inode_free(void)
+{
+	u32 i;
+
+	for (i = 0; i < affs_inode_chunk_cnt; ++i)
+		free(affs_inode_chunk[i]);
+	free(affs_inode_chunk);
+	free(affs_name_pool);
+	free(affs_name_set);
+	free(affs_inode_order);
+	free(affs_inode_hash);
+	affs_inode_chunk = NULL;
+	affs_name_pool = NULL;
+	affs_name_set = NULL;
+	affs_inode_order = NULL;
+	affs_inode_hash = NULL;
+	affs_inode_chunk_cnt = affs_inode_chunk_size = affs_inode_cnt = 0;
+	affs_name_len = affs_name_size = affs_name_mask = affs_name_cnt = 0;
+	affs_inode_nomem = 0;
+}
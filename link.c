@@ -0,0 +1,117 @@
+/* 
+ *  Copyright (C) 2000  Roman Zippel
+ *  
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *  
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "affs_config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "amigaffs.h"
+
+/*
+ * hard links
+ *
+ * A hard link (ST_LINKFILE or ST_LINKDIR) points to the header of the
+ * original object, which starts a chain of all links to it through
+ * link_chain. The links of every object and its link chain are checked
+ * against each other with the inode table built during the walk,
+ * without reading any block again.
+ */
+
+/* flags of the inode table records: */
+/* the link was found in the chain of its original */
+#define AFFS_LINK_CHAINED	1
+/* the link was reported already */
+#define AFFS_LINK_BAD		2
+
+/* the type of a link to an object of the given type */
+static s8 affs_link_type(s8 type)
+{
+	switch (type) {
+	case ST_FILE:
+		return ST_LINKFILE;
+	case ST_USERDIR:
+		return ST_LINKDIR;
+	}
+	return 0;
+}
+
+/*
+ * Check that every hard link points to an object of the right type and
+ * that it is found in the link chain of this object, which may only
+ * contain links to it.
+ */
+int affs_check_links(void)
+{
+	struct affs_inode *s, *o;
+	u32 i, cnt, next, links = 0, bad = 0;
+
+	cnt = affs_inode_count();
+	for (i = 0; i < cnt; ++i) {
+		s = affs_inode_nth(i);
+		if (s->type != ST_LINKFILE && s->type != ST_LINKDIR)
+			continue;
+		links++;
+		o = affs_inode_find(s->original);
+		if (!o) {
+			affs_error("hard link %u points to %u, which isn't a directory entry\n",
+				   s->key, s->original);
+		} else if (affs_link_type(o->type) != s->type) {
+			affs_error("hard link %u points to %u, which isn't a %s\n", s->key,
+				   s->original, s->type == ST_LINKFILE ? "file" : "directory");
+		} else
+			continue;
+		s->flags |= AFFS_LINK_BAD;
+		bad++;
+	}
+	if (!links)
+		return 0;
+
+	for (i = 0; i < cnt; ++i) {
+		o = affs_inode_nth(i);
+		if (!affs_link_type(o->type))
+			continue;
+		for (next = o->link_chain; next; next = s->link_chain) {
+			s = affs_inode_find(next);
+			if (!s || s->type != affs_link_type(o->type) || s->original != o->key) {
+				affs_error("link chain of %u contains %u, which isn't a link to it\n",
+					   o->key, next);
+				bad++;
+				break;
+			}
+			if (s->flags & AFFS_LINK_CHAINED) {
+				affs_error("link chain of %u has a loop at %u\n", o->key, next);
+				bad++;
+				break;
+			}
+			s->flags |= AFFS_LINK_CHAINED;
+		}
+	}
+
+	for (i = 0; i < cnt; ++i) {
+		s = affs_inode_nth(i);
+		if ((s->type != ST_LINKFILE && s->type != ST_LINKDIR) || s->flags)
+			continue;
+		affs_error("hard link %u is missing from the link chain of %u\n",
+			   s->key, s->original);
+		bad++;
+	}
+	if (bad)
+		affs_print(1, "%u errors in the %u hard links\n", bad, links);
+	return 0;
+}
@@ -49,9 +49,10 @@ static struct argp_option argo[] = {
 	{ "root",	'b',	"rootblock",	0,	"Specify root block" },
 	{ "size",	's',	"size",		0,	"Set blocksize" },
 	{ "reserve",	'r',	"blocks",	0,	"Set reserved blocks" },
+	{ "cache",	'm',	"kbytes",	0,	"Set block cache size" },
 	{ "ofs",	'o',	0,		0,	"Old filesystem format"  },
 	{ "intl",	'i',	0,		0,	"International dir format" },
-	{ "dircache",	'd',	0,		0,	"Use dir cache" },
+	{ "dircache",	'd',	0,		0,	"Use dir cache (implies -i)" },
 	{ 0 }
 };
 
@@ -67,7 +68,7 @@ typedef int error_t;
 
 static void argp_usage(struct argp_state *state)
 {
-	fprintf(stderr,"Usage: mkaffs [-void] [-b root] [-s blocksize] [-r reserved] devicefile name\n");
+	fprintf(stderr,"Usage: mkaffs [-void] [-b root] [-s blocksize] [-r reserved] [-m kbytes] devicefile name\n");
 	exit(1);
 }
 #endif
@@ -82,25 +83,14 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 		info.root = atoi(arg);
 		break;
 	case 's':
-		info.blocksize = atoi(arg);
-		switch (info.blocksize) {
-		case 512:
-			info.blockshift = 9;
-			break;
-		case 1024:
-			info.blockshift = 10;
-			break;
-		case 2048:
-			info.blockshift = 11;
-			break;
-		case 4096:
-			info.blockshift = 12;
-			break;
-		default:
-			affs_error("invalid block size %d\n", info.blocksize);
+		if (affs_set_blocksize(atoi(arg))) {
+			affs_error("invalid block size %d\n", atoi(arg));
 			exit(1);
 		}
 		break;
+	case 'm':
+		info.cachesize = atoi(arg);
+		break;
 	case 'r':
 		info.reserved = atoi(arg);
 		break;
@@ -144,8 +134,8 @@ int main(int argc, char **argv)
 
 	memset(&info, 0, sizeof(info));
 	info.reserved = 2;
-	info.blocksize = 512;
-	info.blockshift = 9;
+	info.cachesize = AFFS_CACHESIZE_DEF;
+	affs_set_blocksize(AFFS_BLOCKSIZE_MIN);
 
 #if HAVE_ARGP_H
 	if (argp_parse(&argp, argc, argv, 0, 0, &info))
@@ -153,7 +143,7 @@ int main(int argc, char **argv)
 #else
 {
 	int c;
-	while ((c = getopt (argc, argv, "vb:s:r:nf")) != -1) {
+	while ((c = getopt (argc, argv, "vb:s:r:m:nf")) != -1) {
 		parse_opt(c, optarg, NULL);
 	}
 	if (optind > argc - 2) {
@@ -178,6 +168,7 @@ int main(int argc, char **argv)
 
 	if (S_ISREG(stat.st_mode)) {
 		info.blocks = stat.st_size >> info.blockshift;
+		affs_map_device(stat.st_size);
 	} else if (S_ISBLK(stat.st_mode)) {
 		ioctl(info.devfd, BLKGETSIZE, &info.blocks);
 		info.blocks >>= info.blockshift - 9;
@@ -190,15 +181,21 @@ int main(int argc, char **argv)
 
 	affs_init_root();
 
-	printf("blocks: %d\n", info.blocks);
-	printf("blocksize: %d\n", info.blocksize);
-	printf("reserved blocks: %d\n", info.reserved);
-	printf("rootblock: %d\n", info.root);
+	affs_print(0, "blocks: %d\n", info.blocks);
+	affs_print(0, "blocksize: %d\n", info.blocksize);
+	affs_print(0, "reserved blocks: %d\n", info.reserved);
+	affs_print(0, "rootblock: %d\n", info.root);
 
-	affs_create_bitmap();
+	if (affs_create_bitmap())
+		return 1;
+	if (info.dcache)
+		affs_create_dcache(info.root);
 	affs_write_bitmap();
 	affs_write_root();
 	affs_write_type();
+	affs_bsync();
+
+	affs_cache_stat();
 
 	return 0;
 }
@@ -21,9 +21,485 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
 
 #include "amigaffs.h"
 
+/*
+ * The output of a thread can be redirected into a buffer, so the output
+ * of tasks running in parallel can be printed later in a fixed order
+ * (see affs_walk_threads). The output of the main thread is collected in
+ * a large buffer too, which is written when it's full (after every line
+ * if stdout is a terminal) and at exit.
+ *
+ * In the structured formats (JSON Lines and CSV) every line of a message
+ * is turned into a record as soon as it's complete. The entries of the
+ * directory listing are printed by affs_print_entry with a field per
+ * value, which does nothing at all if the listing isn't printed.
+ *
+ * If the main output can't grow, its finished output is written right
+ * away to make room, whatever still doesn't fit (or doesn't fit into the
+ * output of another thread) is written unbuffered. The output isn't in
+ * order anymore then and a message might be split into several records
+ * or cut short, but the check goes on.
+ */
+#define AFFS_OUTPUT_SIZE	(1 << 20)
+/* kind of a line: the level of a message or an error */
+#define AFFS_LINE_ERROR		(-1)
+
+static void affs_out_line(struct affs_output *out, size_t end);
+
+#if HAVE_LIBPTHREAD
+static pthread_key_t affs_output_key;
+static pthread_once_t affs_output_once = PTHREAD_ONCE_INIT;
+
+static void affs_output_init(void)
+{
+	pthread_key_create(&affs_output_key, NULL);
+}
+
+static struct affs_output *affs_get_output(void)
+{
+	pthread_once(&affs_output_once, affs_output_init);
+	return pthread_getspecific(affs_output_key);
+}
+
+static void affs_put_output(struct affs_output *out)
+{
+	pthread_setspecific(affs_output_key, out);
+}
+#else
+static struct affs_output *affs_output;
+
+#define affs_get_output()	affs_output
+#define affs_put_output(out)	(affs_output = (out))
+#endif
+
+void affs_set_output(struct affs_output *out)
+{
+	struct affs_output *old = affs_get_output();
+
+	/* a record must not be split between two outputs */
+	if (old && info.format != AFFS_FORMAT_TEXT && old->line < old->len)
+		affs_out_line(old, old->len);
+	affs_put_output(out);
+}
+
+
+/* output of the main thread */
+static struct affs_output affs_stdout;
+static int affs_stdout_tty = -1;
+
+/*
+ * Write the finished output of out. Only the main output is written
+ * before its time, the tasks remember positions in the output of the
+ * other threads.
+ */
+static void affs_out_flush(struct affs_output *out)
+{
+	size_t len = info.format != AFFS_FORMAT_TEXT ? out->line : out->len;
+
+	if (!len || out != &affs_stdout)
+		return;
+	fwrite(out->buf, 1, len, stdout);
+	fflush(stdout);
+	out->len -= len;
+	out->line = info.format != AFFS_FORMAT_TEXT ? out->line - len : 0;
+	memmove(out->buf, out->buf + len, out->len);
+}
+
+/* make room for need more bytes, returns -1 if out can't grow */
+static int affs_out_grow(struct affs_output *out, size_t need)
+{
+	size_t size;
+	char *buf;
+
+	if (out->len + need < out->size)
+		return 0;
+	size = out->size ? 2 * out->size : 256;
+	while (size <= out->len + need)
+		size *= 2;
+	buf = realloc(out->buf, size);
+	if (!buf)
+		return -1;
+	out->buf = buf;
+	out->size = size;
+	return 0;
+}
+
+/*
+ * The functions below add to a record or to the text output. Records
+ * are only added when out has no unfinished line, so if the main output
+ * can't grow, all of it can be written to make room. If that's not
+ * enough either, they write to stdout directly.
+ */
+static void affs_out_spill(struct affs_output *out)
+{
+	if (!out->len || out != &affs_stdout)
+		return;
+	fwrite(out->buf, 1, out->len, stdout);
+	out->len = out->line = 0;
+}
+
+static int affs_out_room(struct affs_output *out, size_t need)
+{
+	if (!affs_out_grow(out, need))
+		return 0;
+	affs_out_spill(out);
+	return out->len + need < out->size ? 0 : -1;
+}
+
+/*
+ * A record, which doesn't fit into its output, is put together in a
+ * buffer on the stack (the text of a message in pieces) and written
+ * with a single call, so it can't be mixed with the output of another
+ * thread.
+ */
+#define AFFS_RECORD_TEXT	128
+#define AFFS_RECORD_SIZE	1024
+
+static void affs_out_put(struct affs_output *out, const char *str, size_t len)
+{
+	if (affs_out_room(out, len)) {
+		fwrite(str, 1, len, stdout);
+		return;
+	}
+	memcpy(out->buf + out->len, str, len);
+	out->len += len;
+}
+
+/* returns -1 if out can't grow, nothing was added then */
+static int affs_out_try_vformat(struct affs_output *out, char *fmt, va_list ap)
+{
+	va_list aq;
+	int len;
+
+	va_copy(aq, ap);
+	len = vsnprintf(out->buf ? out->buf + out->len : NULL, out->size - out->len, fmt, aq);
+	va_end(aq);
+	if (len < 0)
+		return 0;
+	if (len >= out->size - out->len) {
+		if (affs_out_grow(out, len))
+			return -1;
+		vsnprintf(out->buf + out->len, out->size - out->len, fmt, ap);
+	}
+	out->len += len;
+	return 0;
+}
+
+static void affs_out_vformat(struct affs_output *out, char *fmt, va_list ap)
+{
+	va_list aq;
+	int res;
+
+	va_copy(aq, ap);
+	res = affs_out_try_vformat(out, fmt, aq);
+	va_end(aq);
+	if (!res)
+		return;
+	affs_out_spill(out);
+	va_copy(aq, ap);
+	res = affs_out_try_vformat(out, fmt, aq);
+	va_end(aq);
+	if (res)
+		vfprintf(stdout, fmt, ap);
+}
+
+static void affs_out_format(struct affs_output *out, char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	affs_out_vformat(out, fmt, ap);
+	va_end(ap);
+}
+
+/*
+ * a string (in latin-1) as quoted JSON or CSV string in UTF-8, the
+ * caller made room for the whole record
+ */
+static void affs_out_string(struct affs_output *out, const u8 *str, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	int csv = info.format == AFFS_FORMAT_CSV;
+	char *p;
+	u8 c;
+
+	/* the worst case is \u00xx for every character */
+	if (affs_out_room(out, 6 * len + 2))
+		return;
+	p = out->buf + out->len;
+	*p++ = '"';
+	for (; len > 0; ++str, --len) {
+		c = *str;
+		if (c >= 0x80) {
+			*p++ = 0xc0 | (c >> 6);
+			*p++ = 0x80 | (c & 0x3f);
+		} else if (c == '"') {
+			*p++ = csv ? '"' : '\\';
+			*p++ = '"';
+		} else if (csv) {
+			*p++ = c;
+		} else if (c == '\\') {
+			*p++ = '\\';
+			*p++ = '\\';
+		} else if (c < 0x20) {
+			memcpy(p, "\\u00", 4);
+			p[4] = hex[c >> 4];
+			p[5] = hex[c & 15];
+			p += 6;
+		} else
+			*p++ = c;
+	}
+	*p++ = '"';
+	out->len = p - out->buf;
+}
+
+static void affs_out_record(struct affs_output *out, int kind, const char *text, size_t len)
+{
+	if (info.format == AFFS_FORMAT_CSV) {
+		affs_out_format(out, "%s,,,,,,,,", kind == AFFS_LINE_ERROR ? "error" : "message");
+		affs_out_string(out, (const u8 *)text, len);
+		affs_out_put(out, "\n", 1);
+		return;
+	}
+	if (kind == AFFS_LINE_ERROR)
+		affs_out_put(out, "{\"error\":", 9);
+	else
+		affs_out_format(out, "{\"level\":%d,\"message\":", kind);
+	affs_out_string(out, (const u8 *)text, len);
+	affs_out_put(out, "}\n", 2);
+}
+
+/* print a message text (of the kind of the line) as record */
+static void affs_out_message(struct affs_output *out, int kind, const char *text, size_t len)
+{
+	char stack[AFFS_RECORD_SIZE];
+	struct affs_output tmp;
+	size_t n;
+
+	if (!affs_out_room(out, 6 * len + 64)) {
+		affs_out_record(out, kind, text, len);
+		return;
+	}
+	memset(&tmp, 0, sizeof(tmp));
+	tmp.buf = stack;
+	tmp.size = sizeof(stack);
+	for (; len > 0; text += n, len -= n) {
+		n = len < AFFS_RECORD_TEXT ? len : AFFS_RECORD_TEXT;
+		tmp.len = 0;
+		affs_out_record(&tmp, kind, text, n);
+		fwrite(tmp.buf, 1, tmp.len, stdout);
+	}
+}
+
+/*
+ * Turn the unfinished line up to end (at a newline or the end of the
+ * output) into a record, whatever follows the newline stays as the start
+ * of the next line.
+ */
+static void affs_out_line(struct affs_output *out, size_t end)
+{
+	char stack[256], *text = stack;
+	struct affs_output tmp;
+	size_t len, next, rest;
+
+	len = end - out->line;
+	next = end < out->len ? end + 1 : end;
+	rest = out->len - next;
+	if (len + rest > sizeof(stack)) {
+		text = malloc(len + rest);
+		if (!text) {
+			/* write the record right away (after what's finished) */
+			next -= out->line;
+			affs_out_flush(out);
+			next += out->line;
+			memset(&tmp, 0, sizeof(tmp));
+			if (len)
+				affs_out_message(&tmp, out->kind, out->buf + out->line, len);
+			if (tmp.len)
+				fwrite(tmp.buf, 1, tmp.len, stdout);
+			free(tmp.buf);
+			memmove(out->buf + out->line, out->buf + next, rest);
+			out->len = out->line + rest;
+			return;
+		}
+	}
+	memcpy(text, out->buf + out->line, len);
+	memcpy(text + len, out->buf + next, rest);
+	out->len = out->line;
+	/* empty lines are only separators in the text format */
+	if (len)
+		affs_out_message(out, out->kind, text, len);
+	out->line = out->len;
+	affs_out_put(out, text + len, rest);
+	if (text != stack)
+		free(text);
+}
+
+/* write the finished output of the main thread */
+static void affs_flush(void)
+{
+	affs_out_flush(&affs_stdout);
+}
+
+static void affs_flush_exit(void)
+{
+	if (info.format != AFFS_FORMAT_TEXT && affs_stdout.line < affs_stdout.len)
+		affs_out_line(&affs_stdout, affs_stdout.len);
+	affs_flush();
+	free(affs_stdout.buf);
+	affs_stdout.buf = NULL;
+	affs_stdout.len = affs_stdout.size = affs_stdout.line = 0;
+}
+
+static void affs_main_init(void)
+{
+	affs_stdout_tty = isatty(fileno(stdout));
+	atexit(affs_flush_exit);
+	affs_out_grow(&affs_stdout, AFFS_OUTPUT_SIZE);
+	if (info.format == AFFS_FORMAT_CSV)
+		affs_out_format(&affs_stdout,
+				"record,key,name,type,size,date,protect,comment,message\n");
+	affs_stdout.line = affs_stdout.len;
+}
+
+#if HAVE_LIBPTHREAD
+static pthread_once_t affs_main_once = PTHREAD_ONCE_INIT;
+#endif
+
+/*
+ * The output of the main thread, it's set up on first use. Only the
+ * main thread may add to it, every other thread must set its own
+ * output (see affs_set_output), which is added with affs_write after
+ * the thread is done.
+ */
+static struct affs_output *affs_main_output(void)
+{
+#if HAVE_LIBPTHREAD
+	pthread_once(&affs_main_once, affs_main_init);
+#else
+	if (affs_stdout_tty < 0)
+		affs_main_init();
+#endif
+	return &affs_stdout;
+}
+
+static struct affs_output *affs_cur_output(void)
+{
+	struct affs_output *out = affs_get_output();
+
+	return out ? out : affs_main_output();
+}
+
+/* some new output was added to out at start */
+static void affs_out_done(struct affs_output *out, size_t start)
+{
+	if (out != &affs_stdout)
+		return;
+	if (out->len >= AFFS_OUTPUT_SIZE)
+		affs_flush();
+	else if (affs_stdout_tty) {
+		/* a record is always finished, a text line when it has its newline */
+		if (info.format != AFFS_FORMAT_TEXT ? out->line > 0 :
+		    memchr(out->buf + start, '\n', out->len - start) != NULL)
+			affs_flush();
+	}
+}
+
+/* the records of a message, which doesn't fit into out, are written right away */
+static void affs_out_vmessage(struct affs_output *out, int kind, char *fmt, va_list ap)
+{
+	char text[1024], *p, *nl;
+	int len;
+
+	len = vsnprintf(text, sizeof(text), fmt, ap);
+	if (len < 0)
+		return;
+	if (len >= (int)sizeof(text))
+		len = sizeof(text) - 1;
+	/* the unfinished line becomes a record of its own, and so does the rest */
+	if (out->line < out->len)
+		affs_out_line(out, out->len);
+	for (p = text; p < text + len; p = nl + 1) {
+		nl = memchr(p, '\n', text + len - p);
+		if (!nl)
+			nl = text + len;
+		if (nl > p)
+			affs_out_message(out, kind, p, nl - p);
+		out->line = out->len;
+	}
+	out->kind = kind;
+	affs_out_done(out, out->line);
+}
+
+static void affs_vprint(int kind, char *fmt, va_list ap)
+{
+	struct affs_output *out = affs_cur_output();
+	size_t start, end;
+	va_list aq;
+	char *nl;
+	int res;
+
+	if (info.format == AFFS_FORMAT_TEXT) {
+		start = out->len;
+		va_copy(aq, ap);
+		res = affs_out_try_vformat(out, fmt, aq);
+		va_end(aq);
+		if (res) {
+			/* written or added at the start after the rest was written */
+			affs_out_vformat(out, fmt, ap);
+			start = 0;
+		}
+		affs_out_done(out, start);
+		return;
+	}
+
+	/* a message can't continue a line of another kind */
+	if (out->line < out->len && out->kind != kind)
+		affs_out_line(out, out->len);
+	if (out->line == out->len)
+		out->kind = kind;
+	start = out->len;
+	va_copy(aq, ap);
+	res = affs_out_try_vformat(out, fmt, aq);
+	va_end(aq);
+	if (res) {
+		/* make room, but keep the unfinished line */
+		affs_out_flush(out);
+		start = out->len;
+		va_copy(aq, ap);
+		res = affs_out_try_vformat(out, fmt, aq);
+		va_end(aq);
+		if (res) {
+			affs_out_vmessage(out, kind, fmt, ap);
+			return;
+		}
+	}
+	while ((nl = memchr(out->buf + start, '\n', out->len - start))) {
+		end = nl - out->buf;
+		affs_out_line(out, end);
+		out->kind = kind;
+		start = out->line;
+	}
+	affs_out_done(out, out->line);
+}
+
+static void affs_printf(int kind, char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	affs_vprint(kind, fmt, ap);
+	va_end(ap);
+}
+
 void affs_print(int level, char *fmt, ...)
 {
 	va_list ap;
@@ -32,7 +508,7 @@ void affs_print(int level, char *fmt, ...)
 		return;
 
 	va_start(ap, fmt);
-	vprintf(fmt, ap);
+	affs_vprint(level, fmt, ap);
 	va_end(ap);
 }
 
@@ -40,9 +516,232 @@ void affs_error(char *fmt, ...)
 {
 	va_list ap;
 
-	printf("%s: ", affs_prog);
+	affs_atomic_add(&info.errstat.errors, 1);
+	if (info.format == AFFS_FORMAT_TEXT)
+		affs_printf(AFFS_LINE_ERROR, "%s: ", affs_prog);
 	va_start(ap, fmt);
-	vprintf(fmt, ap);
+	affs_vprint(AFFS_LINE_ERROR, fmt, ap);
 	va_end(ap);
 }
 
+/* append len bytes of finished output of another thread to the main output */
+void affs_write(char *buf, size_t len)
+{
+	struct affs_output *out = affs_main_output();
+	size_t start;
+
+	if (info.format != AFFS_FORMAT_TEXT && out->line < out->len)
+		affs_out_line(out, out->len);
+	if (affs_out_room(out, len)) {
+		fwrite(buf, 1, len, stdout);
+		return;
+	}
+	start = out->len;
+	affs_out_put(out, buf, len);
+	if (info.format != AFFS_FORMAT_TEXT)
+		out->line = out->len;
+	affs_out_done(out, start);
+}
+
+/*
+ * Amiga dates are converted to the local time without a localtime() call
+ * for every entry. The offset of the local time is cached for every day
+ * (of the 32 bit time the dates are computed in) it doesn't change during
+ * the day, the date is computed from it.
+ */
+struct affs_tm {
+	int year, mon, mday, wday;
+	int hour, min, sec;
+};
+
+static const char affs_wday_name[7][4] = {
+	"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
+};
+static const char affs_mon_name[12][4] = {
+	"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+#define AFFS_DATE_DAYS		(0x100000000ULL / (24 * 60 * 60) + 1)
+/* offset of the local time during a day, shifted left by one and the lowest bit set */
+static s32 affs_date_offset[AFFS_DATE_DAYS];
+
+/* # of days from 1.1.1970 to the given date */
+static long affs_days_from_civil(long year, int mon, int mday)
+{
+	long era, yoe, doy;
+
+	year -= mon <= 2;
+	era = (year >= 0 ? year : year - 399) / 400;
+	yoe = year - era * 400;
+	doy = (153 * (mon > 2 ? mon - 3 : mon + 9) + 2) / 5 + mday - 1;
+	return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+static void affs_civil_from_days(long days, struct affs_tm *tm)
+{
+	long era, doe, yoe, doy, mp;
+
+	days += 719468;
+	era = (days >= 0 ? days : days - 146096) / 146097;
+	doe = days - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	tm->mday = doy - (153 * mp + 2) / 5 + 1;
+	tm->mon = mp < 10 ? mp + 2 : mp - 10;
+	tm->year = yoe + era * 400 + (tm->mon < 2);
+}
+
+/* offset of the local time at t */
+static long affs_local_offset(time_t t)
+{
+	struct tm tm;
+
+	if (!localtime_r(&t, &tm))
+		return 0;
+	return (affs_days_from_civil(tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday) * 86400LL +
+		tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec) - t;
+}
+
+static void affs_local_date(struct affs_date *date, struct affs_tm *tm)
+{
+	u32 time, day;
+	long long local;
+	long off, days, secs;
+	s32 cache;
+
+	time = (be32_to_cpu(date->days) * (24 * 60 * 60)) +
+	       (be32_to_cpu(date->mins) * 60) +
+	       (be32_to_cpu(date->ticks) / 50) +
+	       ((8 * 365 + 2) * 24 * 60 * 60);
+	day = time / (24 * 60 * 60);
+	cache = affs_atomic_load(&affs_date_offset[day]);
+	if (cache)
+		off = cache >> 1;
+	else {
+		off = affs_local_offset((time_t)day * (24 * 60 * 60));
+		if (off == affs_local_offset((time_t)day * (24 * 60 * 60) + (24 * 60 * 60 - 1)))
+			affs_atomic_store(&affs_date_offset[day], (s32)(off * 2) | 1);
+		else
+			off = affs_local_offset(time);
+	}
+
+	local = (long long)time + off;
+	days = local / (24 * 60 * 60);
+	secs = local % (24 * 60 * 60);
+	if (secs < 0) {
+		days--;
+		secs += 24 * 60 * 60;
+	}
+	affs_civil_from_days(days, tm);
+	tm->wday = (days % 7 + 11) % 7;
+	tm->hour = secs / 3600;
+	tm->min = secs / 60 % 60;
+	tm->sec = secs % 60;
+}
+
+static const char *affs_type_name(s32 type)
+{
+	switch (type) {
+	case ST_FILE:
+		return "file";
+	case ST_USERDIR:
+		return "dir";
+	case ST_SOFTLINK:
+		return "softlink";
+	case ST_LINKFILE:
+		return "filelink";
+	case ST_LINKDIR:
+		return "dirlink";
+	}
+	return "unknown";
+}
+
+/* print an entry of the directory listing */
+void affs_print_entry(int level, struct affs_listing *entry)
+{
+	struct affs_tm tm;
+	char col[16];
+	const char *type;
+	char stack[AFFS_RECORD_SIZE];
+	struct affs_output *out, tmp;
+	size_t start;
+	int nlen, clen;
+
+	if (level > info.verbose)
+		return;
+
+	nlen = entry->name[0] > AFFS_NAME_MAX ? AFFS_NAME_MAX : entry->name[0];
+	clen = entry->comment[0] > AFFS_COMMENT_MAX ? AFFS_COMMENT_MAX : entry->comment[0];
+	affs_local_date(entry->date, &tm);
+
+	if (info.format == AFFS_FORMAT_TEXT) {
+		switch (entry->type) {
+		case ST_FILE:
+			snprintf(col, sizeof(col), "%10u ", entry->size);
+			break;
+		case ST_USERDIR:
+			strcpy(col, "     <DIR> ");
+			break;
+		case ST_LINKFILE:
+			strcpy(col, "<FILELINK> ");
+			break;
+		case ST_LINKDIR:
+			strcpy(col, " <LINKDIR> ");
+			break;
+		case ST_SOFTLINK:
+			strcpy(col, "<SOFTLINK> ");
+			break;
+		default:
+			strcpy(col, "     <?\?\?> ");
+			break;
+		}
+		affs_printf(level, "%10u %-30.*s %s%s %s %2d %02d:%02d:%02d %d %s%.*s\n",
+			    entry->key, nlen, entry->name + 1, col,
+			    affs_wday_name[tm.wday], affs_mon_name[tm.mon], tm.mday,
+			    tm.hour, tm.min, tm.sec, tm.year,
+			    entry->type == ST_FILE ? "" : " ", clen, entry->comment + 1);
+		return;
+	}
+
+	out = affs_cur_output();
+	if (out->line < out->len)
+		affs_out_line(out, out->len);
+	if (affs_out_room(out, 6 * (nlen + clen) + 256)) {
+		memset(&tmp, 0, sizeof(tmp));
+		tmp.buf = stack;
+		tmp.size = sizeof(stack);
+		out = &tmp;
+	}
+	start = out->len;
+	type = affs_type_name(entry->type);
+	if (info.format == AFFS_FORMAT_CSV) {
+		affs_out_format(out, "entry,%u,", entry->key);
+		affs_out_string(out, entry->name + 1, nlen);
+		affs_out_format(out, ",%s,", type);
+		if (entry->type == ST_FILE)
+			affs_out_format(out, "%u", entry->size);
+		affs_out_format(out, ",%04d-%02d-%02dT%02d:%02d:%02d,%u,",
+				tm.year, tm.mon + 1, tm.mday, tm.hour, tm.min, tm.sec, entry->protect);
+		affs_out_string(out, entry->comment + 1, clen);
+		affs_out_put(out, ",\n", 2);
+	} else {
+		affs_out_format(out, "{\"key\":%u,\"name\":", entry->key);
+		affs_out_string(out, entry->name + 1, nlen);
+		affs_out_format(out, ",\"type\":\"%s\"", type);
+		if (entry->type == ST_FILE)
+			affs_out_format(out, ",\"size\":%u", entry->size);
+		if (entry->type == ST_LINKFILE || entry->type == ST_LINKDIR)
+			affs_out_format(out, ",\"original\":%u", entry->original);
+		affs_out_format(out, ",\"date\":\"%04d-%02d-%02dT%02d:%02d:%02d\",\"protect\":%u,\"comment\":",
+				tm.year, tm.mon + 1, tm.mday, tm.hour, tm.min, tm.sec, entry->protect);
+		affs_out_string(out, entry->comment + 1, clen);
+		affs_out_put(out, "}\n", 2);
+	}
+	if (out == &tmp) {
+		fwrite(tmp.buf, 1, tmp.len, stdout);
+		return;
+	}
+	out->line = out->len;
+	affs_out_done(out, start);
+}